@@ -0,0 +1,294 @@
+# Copyright (c) 2024 Jamie M.
+#
+# All right reserved. This code is not apache or FOSS/copyleft licensed.
+
+# Collects readings from several dongles at once. The sensors of a roster file (one
+# "<address> [name]" per line, addresses as shown by "ess status") are split across the dongles,
+# each reading is output once even if more than one dongle receives the sensor, and a sensor
+# which its dongle has not received for a while is moved to another dongle. Dongles need the
+# CSV output format. Readings are output in the same format as test.py. dongle_stub.py
+# provides pseudo-terminal stand-ins for trying it without hardware.
+#
+# The firmware only removes roster devices whilst it is disabled and every link is down, as
+# removing one renumbers the devices after it. Removing a sensor from a dongle, which happens on
+# each fail over and when partitioning finds a sensor on more than one dongle, therefore drops
+# every link of that dongle until it has reconnected, typically a few seconds per sensor. Keep
+# --failover well above the reconnection time so that this does not cascade.
+
+import argparse
+import sys
+import time
+import serial
+
+def now_ms():
+    return int(time.time() * 1000)
+
+class Dongle:
+    def __init__(self, port, slots):
+        self.port = port
+        self.slots = slots
+        self.serial = serial.Serial(port, 115200, timeout=0.3)
+        self.alive = True
+        # Address: device number on this dongle
+        self.roster = {}
+
+    def command(self, text):
+        # The shell has no prompt, the response ends when no more lines arrive
+        self.serial.write(text.encode("utf-8") + b"\r\n")
+        lines = []
+
+        while True:
+            line = self.serial.readline()
+
+            if len(line) == 0:
+                break
+
+            line = line.decode("utf-8", errors="ignore").strip()
+
+            if len(line) > 0 and line != text:
+                lines.append(line)
+
+        return lines
+
+    def refresh(self):
+        self.roster = {}
+
+        for line in self.command("ess status"):
+            columns = [column.strip() for column in line.split("|")]
+
+            # Rows of remote devices, the local sensor has no address
+            if len(columns) > 2 and columns[0].isdigit() and len(columns[1]) == 14:
+                try:
+                    int(columns[1], 16)
+                except ValueError:
+                    continue
+
+                self.roster[columns[1].lower()] = int(columns[0])
+
+    def add(self, address, name):
+        self.command("ess roster add " + address + ("" if name is None else " " + name))
+        self.refresh()
+        return address in self.roster
+
+    # Returns False if the firmware still refused to remove the sensor
+    def remove(self, address):
+        if address not in self.roster:
+            return True
+
+        # Devices can only be removed once the dongle has disconnected from all of them, its
+        # other sensors reconnect after it is enabled again
+        self.command("ess disable")
+        attempts = 0
+
+        while attempts < 10:
+            lines = self.command("ess roster remove " + str(self.roster[address]))
+
+            if not any("must be disabled" in line for line in lines):
+                break
+
+            time.sleep(0.5)
+            attempts = attempts + 1
+
+        self.command("ess enable")
+        self.refresh()
+        return address not in self.roster
+
+    # Returns the readings received since the last call as (address, time, {field: value})
+    def readings(self):
+        result = []
+        header = None
+        numbers = {number: address for address, number in self.roster.items()}
+
+        for line in self.command("ess readings 0"):
+            columns = line.rstrip(",").split(",")
+
+            if columns[0] == "device":
+                header = columns
+                continue
+
+            if header is None or len(columns) != len(header) or not columns[0].isdigit():
+                continue
+
+            row = dict(zip(header, columns))
+            address = row.get("address", numbers.get(int(row["device"])))
+
+            if address is None or address == "LOCAL":
+                continue
+
+            fields = {}
+
+            for name in header:
+                if name not in ("device", "address", "name", "time"):
+                    fields[name] = row[name]
+
+            result.append((address.lower(), int(row.get("time", now_ms())), fields))
+
+        return result
+
+class Collector:
+    def __init__(self, args):
+        self.args = args
+        self.dongles = []
+        # Address: name or None
+        self.sensors = {}
+        # Address: dongle which should receive it
+        self.assigned = {}
+        # Address: time its assigned dongle last received it (or it was assigned)
+        self.heard = {}
+        # Address: dongles which already lost it, skipped when failing over
+        self.lost_by = {}
+        # Address: (time, fields) last output
+        self.last = {}
+        # (dongle, address) copies which the dongle refused to remove, retried on each poll
+        self.leftovers = []
+
+        with open(args.roster, "r") as f:
+            for line in f:
+                parts = line.split("#")[0].split()
+
+                if len(parts) > 0:
+                    self.sensors[parts[0].lower()] = parts[1] if len(parts) > 1 else None
+
+        for port in args.dongles:
+            dongle = Dongle(port, args.slots)
+            # Timestamps of all dongles then share the host clock, needed for de-duplication
+            dongle.command("app time " + str(now_ms()))
+            dongle.refresh()
+            self.dongles.append(dongle)
+
+    def log(self, text):
+        print(text, file=sys.stderr)
+
+    def drop(self, dongle, address):
+        if not dongle.remove(address):
+            self.log("%s: failed to remove %s, retrying" % (dongle.port, address))
+
+            if (dongle, address) not in self.leftovers:
+                self.leftovers.append((dongle, address))
+
+    def retry_drops(self):
+        for dongle, address in list(self.leftovers):
+            # A sensor since placed back on the dongle is kept
+            if not dongle.alive or self.assigned.get(address) is dongle or \
+               dongle.remove(address):
+                self.leftovers.remove((dongle, address))
+
+    def load(self, dongle):
+        return sum(1 for address in self.assigned if self.assigned[address] is dongle)
+
+    def place(self, address, exclude):
+        candidates = [dongle for dongle in self.dongles
+                      if dongle.alive and dongle not in exclude and
+                      len(dongle.roster) < dongle.slots]
+
+        if len(candidates) == 0:
+            return None
+
+        dongle = min(candidates, key=self.load)
+
+        if not dongle.add(address, self.sensors[address]):
+            self.log("%s: failed to add %s" % (dongle.port, address))
+            return None
+
+        self.assigned[address] = dongle
+        self.heard[address] = time.monotonic()
+        return dongle
+
+    def partition(self):
+        # Sensors already on a roster stay there, further copies are removed to free connections
+        for dongle in self.dongles:
+            for address in list(dongle.roster):
+                if address not in self.sensors:
+                    continue
+
+                if address in self.assigned:
+                    self.drop(dongle, address)
+                else:
+                    self.assigned[address] = dongle
+                    self.heard[address] = time.monotonic()
+
+        for address in self.sensors:
+            if address not in self.assigned and self.place(address, []) is None:
+                self.log("No dongle has room for %s" % address)
+
+    def fail_over(self, address):
+        old = self.assigned.pop(address, None)
+        lost_by = self.lost_by.setdefault(address, [])
+
+        if old is not None:
+            lost_by.append(old)
+
+            if old.alive:
+                self.drop(old, address)
+
+        new = self.place(address, lost_by)
+
+        if new is None and len(lost_by) > 0:
+            # Every dongle has lost it, start again skipping only the one which lost it last
+            self.lost_by[address] = lost_by = lost_by[-1:]
+            new = self.place(address, lost_by)
+
+        if old is not None or new is not None:
+            self.log("%s: %s -> %s" % (address, "none" if old is None else old.port,
+                                       "none" if new is None else new.port))
+
+    def output(self, dongle, address, received, fields):
+        if self.assigned.get(address) is dongle:
+            self.heard[address] = time.monotonic()
+            self.lost_by.pop(address, None)
+
+        if address in self.last:
+            last_time, last_fields = self.last[address]
+
+            # The same reading received by another dongle, or one already output
+            if received <= last_time or (fields == last_fields and
+                                         received - last_time <= self.args.window):
+                return
+
+        self.last[address] = (received, fields)
+        name = self.sensors.get(address) or address
+        print("sensor" + name + "," + ",".join(key + "=" + value for key, value in fields.items()) +
+              " " + str(received))
+        sys.stdout.flush()
+
+    def poll(self):
+        self.retry_drops()
+
+        for dongle in self.dongles:
+            if not dongle.alive:
+                continue
+
+            try:
+                for address, received, fields in dongle.readings():
+                    self.output(dongle, address, received, fields)
+            except (serial.SerialException, OSError) as e:
+                self.log("%s: lost (%s)" % (dongle.port, e))
+                dongle.alive = False
+
+        for address in list(self.sensors):
+            dongle = self.assigned.get(address)
+
+            if dongle is None or not dongle.alive or \
+               time.monotonic() - self.heard[address] > self.args.failover:
+                self.fail_over(address)
+
+    def run(self):
+        self.partition()
+
+        while True:
+            self.poll()
+            time.sleep(self.args.interval)
+
+parser = argparse.ArgumentParser()
+parser.add_argument("roster", help="File of \"<address> [name]\" lines")
+parser.add_argument("dongles", nargs="+", help="Serial ports of the dongles")
+parser.add_argument("--slots", type=int, default=8,
+                    help="Roster size of each dongle (APP_DEVICE_SLOTS, or its links unless polling)")
+parser.add_argument("--interval", type=float, default=5, help="Seconds between polls")
+parser.add_argument("--failover", type=float, default=120,
+                    help="Seconds without readings before a sensor is moved to another dongle")
+parser.add_argument("--window", type=int, default=2000,
+                    help="Milliseconds within which identical readings are duplicates")
+args = parser.parse_args()
+
+Collector(args).run()
@@ -0,0 +1,140 @@
+# Copyright (c) 2024 Jamie M.
+#
+# All right reserved. This code is not apache or FOSS/copyleft licensed.
+
+# Pseudo-terminal stand-ins for dongles, for trying collector.py without hardware. Prints the
+# path of each stand-in, which answers the shell commands the collector uses with CSV output.
+# Sensor i is in range of stand-ins i and i + 1 (modulo the number of stand-ins) so that some
+# readings are received twice, "--lose DONGLE:SECONDS" takes a stand-in out of range of every
+# sensor after a number of seconds to force a fail over.
+
+import argparse
+import math
+import os
+import select
+import time
+import tty
+
+class Stub:
+    def __init__(self, number, sensors):
+        self.number = number
+        self.master, slave = os.openpty()
+        tty.setraw(slave)
+        self.path = os.ttyname(slave)
+        self.slave = slave
+        self.sensors = sensors
+        self.roster = []
+        self.enabled = True
+        self.offset = 0
+        self.lose_at = None
+        self.output = {}
+        self.line = b""
+
+    def in_range(self, address):
+        if self.lose_at is not None and time.monotonic() >= self.lose_at:
+            return False
+
+        index = self.sensors.index(address) if address in self.sensors else -1
+        count = args.dongles
+        return index >= 0 and (index % count == self.number or (index + 1) % count == self.number)
+
+    def reply(self, lines):
+        os.write(self.master, "".join(line + "\r\n" for line in lines).encode("utf-8"))
+
+    def readings(self):
+        lines = ["device,address,time,temperature,humidity,"]
+        now = int(time.time() * 1000)
+        # Sensors notify once a second, both stand-ins in range see the same reading
+        sample = now - (now % 1000)
+
+        for number, address in enumerate(self.roster):
+            if not self.enabled or not self.in_range(address) or \
+               self.output.get(address, 0) >= sample:
+                continue
+
+            self.output[address] = sample
+            wave = math.sin((sample / 20000.0) + self.sensors.index(address))
+            lines.append("%d,%s,%d,%.2f,%.2f," % (number + 1, address, sample, 20 + (wave * 3),
+                                                   50 + (wave * 10)))
+
+        return lines
+
+    def status(self):
+        lines = ["# | Address        | Name | State       | Readings",
+                 "--|----------------|------|-------------|---------"]
+
+        for number, address in enumerate(self.roster):
+            lines.append("%d | %s |      | %s | 0x0" % (number + 1, address,
+                         "Active     " if self.in_range(address) else "Idle       "))
+
+        return lines
+
+    def command(self, text):
+        words = text.split()
+
+        if words[:2] == ["ess", "status"]:
+            self.reply(self.status())
+        elif words[:2] == ["ess", "readings"]:
+            self.reply(self.readings())
+        elif words[:2] == ["ess", "disable"]:
+            self.enabled = False
+            self.reply(["Application state changed to disabled."])
+        elif words[:2] == ["ess", "enable"]:
+            self.enabled = True
+            self.reply(["Application state changed to enabled."])
+        elif words[:3] == ["ess", "roster", "add"] and len(words) >= 4:
+            if len(self.roster) >= args.slots:
+                self.reply(["Roster is full, it holds %d devices" % args.slots])
+            else:
+                self.roster.append(words[3].lower())
+                self.reply(["Added as #%d" % len(self.roster)])
+        elif words[:3] == ["ess", "roster", "remove"] and len(words) == 4:
+            if self.enabled:
+                self.reply(["Application must be disabled and every device disconnected "
+                            "before removing devices"])
+            else:
+                del self.roster[int(words[3]) - 1]
+                self.reply(["Device removed"])
+        elif words[:2] == ["app", "time"]:
+            self.reply(["Time set"])
+        else:
+            self.reply([text + ": command not found"])
+
+    def receive(self):
+        self.line += os.read(self.master, 256)
+
+        while b"\n" in self.line:
+            text, self.line = self.line.split(b"\n", 1)
+            text = text.decode("utf-8", errors="ignore").strip()
+
+            if len(text) > 0:
+                self.command(text)
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--dongles", type=int, default=3)
+parser.add_argument("--sensors", type=int, default=6)
+parser.add_argument("--slots", type=int, default=8)
+parser.add_argument("--lose", action="append", default=[], help="DONGLE:SECONDS")
+args = parser.parse_args()
+
+sensors = ["01%012x" % (0xc00000000000 + i) for i in range(args.sensors)]
+stubs = [Stub(number, sensors) for number in range(args.dongles)]
+
+for lose in args.lose:
+    number, seconds = lose.split(":")
+    stubs[int(number)].lose_at = time.monotonic() + float(seconds)
+
+for stub in stubs:
+    print(stub.path)
+
+print("Roster:")
+
+for address in sensors:
+    print(address)
+
+while True:
+    ready, _, _ = select.select([stub.master for stub in stubs], [], [])
+
+    for stub in stubs:
+        if stub.master in ready:
+            stub.receive()
@@ -0,0 +1,92 @@
+# Copyright (c) 2024 Jamie M.
+#
+# All right reserved. This code is not apache or FOSS/copyleft licensed.
+
+# Prints per-symbol ROM and RAM usage of a Zephyr ELF and checks the totals
+# against a budget, exits with an error if either budget is exceeded.
+
+import argparse
+import sys
+from elftools.elf.elffile import ELFFile
+from elftools.elf.sections import SymbolTableSection
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--elf", required=True)
+parser.add_argument("--flash-base", type=lambda x: int(x, 0), required=True)
+parser.add_argument("--flash-size", type=int, required=True, help="KiB")
+parser.add_argument("--ram-base", type=lambda x: int(x, 0), required=True)
+parser.add_argument("--ram-size", type=int, required=True, help="KiB")
+parser.add_argument("--rom-budget", type=int, required=True)
+parser.add_argument("--ram-budget", type=int, required=True)
+parser.add_argument("--top", type=int, default=25, help="Number of symbols to list per region")
+args = parser.parse_args()
+
+flash_end = args.flash_base + (args.flash_size * 1024)
+ram_end = args.ram_base + (args.ram_size * 1024)
+
+def in_flash(address):
+    return args.flash_base <= address < flash_end
+
+def in_ram(address):
+    return args.ram_base <= address < ram_end
+
+rom_total = 0
+ram_total = 0
+rom_symbols = {}
+ram_symbols = {}
+
+with open(args.elf, "rb") as f:
+    elf = ELFFile(f)
+
+    # Totals come from the loadable segments, initialised data counts towards both
+    for segment in elf.iter_segments():
+        if segment["p_type"] != "PT_LOAD":
+            continue
+
+        if in_flash(segment["p_paddr"]):
+            rom_total += segment["p_filesz"]
+
+        if in_ram(segment["p_vaddr"]):
+            ram_total += segment["p_memsz"]
+
+    for section in elf.iter_sections():
+        if not isinstance(section, SymbolTableSection):
+            continue
+
+        for symbol in section.iter_symbols():
+            size = symbol["st_size"]
+            kind = symbol["st_info"]["type"]
+
+            if size == 0 or kind not in ("STT_OBJECT", "STT_FUNC") or not symbol.name:
+                continue
+
+            # Thumb functions have the low bit set
+            address = symbol["st_value"] & ~1
+
+            if in_flash(address):
+                rom_symbols[symbol.name] = rom_symbols.get(symbol.name, 0) + size
+            elif in_ram(address):
+                ram_symbols[symbol.name] = ram_symbols.get(symbol.name, 0) + size
+
+def report(title, symbols, total, budget):
+    print("%s: %d / %d bytes (%.1f%%)" % (title, total, budget, (total * 100.0) / budget))
+    print("  %8s  %6s  %s" % ("Size", "Share", "Symbol"))
+
+    for name, size in sorted(symbols.items(), key=lambda x: x[1], reverse=True)[:args.top]:
+        print("  %8d  %5.1f%%  %s" % (size, (size * 100.0) / total, name))
+
+    print("")
+
+    return total <= budget
+
+rom_ok = report("ROM", rom_symbols, rom_total, args.rom_budget)
+ram_ok = report("RAM", ram_symbols, ram_total, args.ram_budget)
+
+if not rom_ok:
+    print("ERROR: ROM usage exceeds budget by %d bytes" % (rom_total - args.rom_budget))
+
+if not ram_ok:
+    print("ERROR: RAM usage exceeds budget by %d bytes" % (ram_total - args.ram_budget))
+
+if not rom_ok or not ram_ok:
+    sys.exit(1)
@@ -0,0 +1,132 @@
+# Copyright (c) 2024 Jamie M.
+#
+# All right reserved. This code is not apache or FOSS/copyleft licensed.
+
+# Converts, generates and shows notification traces used by "ess trace":
+#   convert <dump> <trace>  Converts "ess trace dump" output to a binary trace
+#   generate <trace>        Generates a synthetic burst trace
+#   show <trace>            Prints each record of a trace
+
+import argparse
+import math
+import struct
+import sys
+
+TRACE_MAGIC = 0x544e5345
+TRACE_VERSION = 1
+HEADER = struct.Struct("<IBBH")
+RECORD = struct.Struct("<IHBBB")
+
+FIELDS = ["temperature", "humidity", "pressure", "dewpoint", "battery"]
+
+def read_trace(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    magic, version, _, records = HEADER.unpack_from(data, 0)
+
+    if magic != TRACE_MAGIC or version != TRACE_VERSION:
+        sys.exit("%s is not a notification trace" % path)
+
+    offset = HEADER.size
+    result = []
+
+    while offset + RECORD.size <= len(data):
+        time, handle, device, field, length = RECORD.unpack_from(data, offset)
+        offset += RECORD.size
+        result.append((time, handle, device, field, data[offset:offset + length]))
+        offset += length
+
+    return records, result
+
+def write_trace(path, records):
+    with open(path, "wb") as f:
+        f.write(HEADER.pack(TRACE_MAGIC, TRACE_VERSION, 0, len(records)))
+
+        for time, handle, device, field, payload in records:
+            f.write(RECORD.pack(time, handle, device, field, len(payload)))
+            f.write(payload)
+
+def convert(args):
+    data = bytearray()
+
+    # Shell output also contains the command echo and prompts, only keep lines of hex
+    with open(args.dump, "r", errors="ignore") as f:
+        for line in f:
+            line = line.strip()
+
+            if len(line) > 0 and len(line) % 2 == 0 and all(c in "0123456789abcdefABCDEF" for c in line):
+                data += bytes.fromhex(line)
+
+    with open(args.trace, "wb") as f:
+        f.write(data)
+
+def payload(field, device, step):
+    # Slowly varying values so that aggregates and alarms have something to work with
+    wave = math.sin((step / 20.0) + device)
+
+    if field == 0:
+        return struct.pack("<H", int((20.0 + (device * 2) + (wave * 3)) * 100) & 0xffff)
+    elif field == 1:
+        return struct.pack("<H", int((50.0 + (wave * 10)) * 100))
+    elif field == 2:
+        return struct.pack("<I", int((101325 + (wave * 500)) * 10))
+    elif field == 3:
+        return struct.pack("<b", int(9 + (wave * 3)))
+
+    return struct.pack("<B", max(0, 100 - (step // 50)))
+
+def generate(args):
+    records = []
+    step = 0
+
+    while step * args.interval < args.seconds * 1000:
+        device = 0
+
+        while device < args.devices:
+            # Devices are staggered within each interval, with each burst of notifications
+            # arriving in the same connection event
+            time = (step * args.interval) + ((device * args.interval) // args.devices)
+
+            for field in range(len(FIELDS)):
+                records.append((time, 0x10 + (field * 3), device, field, payload(field, device, step)))
+
+            device += 1
+
+        step += 1
+
+    if len(records) > 0xffff:
+        sys.exit("Too many records: %d" % len(records))
+
+    write_trace(args.trace, records)
+
+def show(args):
+    count, records = read_trace(args.trace)
+    print("%d records" % count)
+    print("  %8s  %6s  %6s  %-11s  %s" % ("Time", "Device", "Handle", "Field", "Payload"))
+
+    for time, handle, device, field, data in records:
+        name = FIELDS[field] if field < len(FIELDS) else "unknown"
+        print("  %8d  %6d  0x%04x  %-11s  %s" % (time, device, handle, name, data.hex()))
+
+parser = argparse.ArgumentParser()
+commands = parser.add_subparsers(dest="command", required=True)
+
+command = commands.add_parser("convert")
+command.add_argument("dump")
+command.add_argument("trace")
+command.set_defaults(function=convert)
+
+command = commands.add_parser("generate")
+command.add_argument("trace")
+command.add_argument("--devices", type=int, default=3)
+command.add_argument("--seconds", type=int, default=10)
+command.add_argument("--interval", type=int, default=100, help="Milliseconds between bursts")
+command.set_defaults(function=generate)
+
+command = commands.add_parser("show")
+command.add_argument("trace")
+command.set_defaults(function=show)
+
+args = parser.parse_args()
+args.function(args)
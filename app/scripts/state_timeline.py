@@ -0,0 +1,104 @@
+# Copyright (c) 2024 Jamie M.
+#
+# All right reserved. This code is not apache or FOSS/copyleft licensed.
+
+# Converts the connection state trace points of a CTF trace (a directory containing the
+# metadata and stream files) to the Chrome trace event format, which Perfetto or
+# chrome://tracing show as a timeline with one track per device. Each state lasts until the
+# next trace point of the same device, failures and disconnections end it. Needs the
+# babeltrace2 python bindings (bt2).
+
+import argparse
+import json
+import bt2
+
+# Trace point: (state it starts, or None if it ends the current state)
+EVENTS = {
+    "backoff": "Backoff",
+    "connecting": "Connecting",
+    "connected": "Connected",
+    "discover": "Discovering",
+    "discovered": None,
+    "discover_empty": "Stalled",
+    "eatt_wait": "Awaiting bearers",
+    "subscribe": "Subscribing",
+    "batch": None,
+    "subscribed": "Subscribed",
+    "active": "Active",
+    "read": "Reading",
+    "polled": "Disconnecting",
+    "tx_power": None,
+    "phy_request": None,
+    "phy": None,
+    "interval": None,
+    "first_reading": None,
+    "connect_failed": None,
+    "stale": None,
+    "timeout": None,
+    "disconnected": None,
+}
+
+parser = argparse.ArgumentParser()
+parser.add_argument("trace", help="CTF trace directory")
+parser.add_argument("output", help="Chrome trace event JSON file")
+args = parser.parse_args()
+
+output = []
+current = {}
+last_time = 0
+
+def close(device, time):
+    if device in current:
+        state, start, arg = current.pop(device)
+        output.append({"name": state, "ph": "X", "pid": 1, "tid": device, "ts": start,
+                       "dur": time - start, "args": {"value": arg}})
+
+for message in bt2.TraceCollectionMessageIterator(args.trace):
+    if type(message) is not bt2._EventMessageConst or message.event.name != "named_event":
+        continue
+
+    name = str(message.event.payload_field["name"])
+    device = int(message.event.payload_field["arg0"])
+    arg = int(message.event.payload_field["arg1"])
+    time = message.default_clock_snapshot.ns_from_origin / 1000.0
+    last_time = time
+
+    if name not in EVENTS:
+        continue
+
+    if name == "discovered":
+        # Attributes found during a discovery step are markers within it
+        output.append({"name": "Attribute 0x%04x" % arg, "ph": "i", "s": "t", "pid": 1,
+                       "tid": device, "ts": time})
+        continue
+
+    if name == "phy":
+        # PHY changes are shown as markers within the current state
+        output.append({"name": "PHY %s" % {1: "1M", 2: "2M", 4: "Coded"}.get(arg, arg), "ph": "i",
+                       "s": "t", "pid": 1, "tid": device, "ts": time})
+        continue
+
+    if name == "tx_power":
+        # TX power changes do not change the state, shown as a counter track
+        output.append({"name": "TX power", "ph": "C", "pid": 1, "tid": device, "ts": time,
+                       "args": {"Device #%d" % (device + 1): arg - (1 << 32) if arg >= (1 << 31) else arg}})
+        continue
+
+    close(device, time)
+
+    if EVENTS[name] is None:
+        output.append({"name": name, "ph": "i", "s": "t", "pid": 1, "tid": device, "ts": time,
+                       "args": {"value": arg}})
+    else:
+        current[device] = (EVENTS[name], time, arg)
+
+# States still in progress at the end of the trace
+for device in list(current):
+    close(device, last_time)
+
+for device in sorted(set(event["tid"] for event in output)):
+    output.append({"name": "thread_name", "ph": "M", "pid": 1, "tid": device,
+                   "args": {"name": "Device #%d" % (device + 1)}})
+
+with open(args.output, "w") as f:
+    json.dump({"traceEvents": output, "displayTimeUnit": "ms"}, f)
@@ -7,6 +7,7 @@
 #include <stddef.h>
 #include <errno.h>
 #include <stdio.h>
+#include <math.h>
 #include <app_version.h>
 #include <zephyr/kernel.h>
 #include <zephyr/types.h>
@@ -16,24 +17,69 @@
 #include <zephyr/drivers/pwm.h>
 #include <zephyr/bluetooth/bluetooth.h>
 #include <zephyr/bluetooth/hci.h>
+#ifdef CONFIG_APP_TX_POWER
+#include <zephyr/bluetooth/hci_vs.h>
+#include <zephyr/net/buf.h>
+#endif
 #include <zephyr/bluetooth/conn.h>
 #include <zephyr/bluetooth/uuid.h>
 #include <zephyr/bluetooth/gatt.h>
+#ifdef CONFIG_APP_EATT
+#include <zephyr/bluetooth/att.h>
+#endif
 #include <zephyr/bluetooth/addr.h>
 #include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/barrier.h>
 #include <zephyr/sys/reboot.h>
 #include <zephyr/shell/shell.h>
+#include <zephyr/zbus/zbus.h>
 #include <zephyr/pm/device.h>
 #include <zephyr/dt-bindings/gpio/nordic-nrf-gpio.h>
 
+#ifdef CONFIG_APP_STACK_REPORT
+#include <zephyr/debug/thread_analyzer.h>
+#endif
+
+#ifdef CONFIG_APP_ROSTER_SETTINGS
+#include <zephyr/settings/settings.h>
+#endif
+
+#ifdef CONFIG_APP_HISTORY
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/fs/fcb.h>
+#endif
+
+#ifdef CONFIG_APP_HISTORY_EXPORT
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/base64.h>
+#endif
+
+#ifdef CONFIG_APP_TELEMETRY
+#include <zephyr/drivers/uart.h>
+#include <zephyr/sys/ring_buffer.h>
+#endif
+
+#ifdef CONFIG_APP_STATE_TRACE
+#include <zephyr/tracing/tracing.h>
+#endif
+
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(abe, CONFIG_APPLICATION_LOG_LEVEL);
 
-#define SENSOR_THREAD_STACK_SIZE 2048
+#define SENSOR_THREAD_STACK_SIZE CONFIG_APP_SENSOR_THREAD_STACK_SIZE
 #define SENSOR_THREAD_PRIORITY 1
 
-#define FAN_THREAD_STACK_SIZE 1024
+#define PIPELINE_THREAD_STACK_SIZE CONFIG_APP_PIPELINE_THREAD_STACK_SIZE
+#define PIPELINE_THREAD_PRIORITY 5
+
+#define BT_WORK_STACK_SIZE CONFIG_APP_BT_WORK_STACK_SIZE
+#define BT_WORK_PRIORITY -1
+
+#define FAN_THREAD_STACK_SIZE CONFIG_APP_FAN_THREAD_STACK_SIZE
 #define FAN_THREAD_PRIORITY 1
+#define FAN_RAMP_TICK_MS CONFIG_APP_FAN_RAMP_TICK
+#define FAN_SPEED_MAX 100
 #define PWM_MAX_PERIOD PWM_SEC(1U) / 64U
 
 enum device_state_t {
@@ -44,6 +90,17 @@ enum device_state_t {
 	STATE_ACTIVE,
 };
 
+#ifdef CONFIG_APP_ADAPTIVE_PHY
+enum phy_policy_t {
+	PHY_POLICY_AUTO = 0,
+	PHY_POLICY_1M,
+	PHY_POLICY_2M,
+	PHY_POLICY_CODED,
+
+	PHY_POLICY_COUNT,
+};
+#endif
+
 enum handle_status_t {
 	FIND_ESS_SERVICE = 0,
 #ifdef CONFIG_APP_ESS_TEMPERATURE
@@ -58,7 +115,7 @@ enum handle_status_t {
 	FIND_PRESSURE,
 	FIND_PRESSURE_CCC,
 #endif
-#ifdef CONFIG_APP_ESS_DEW_POINT
+#ifdef CONFIG_APP_ESS_DEW_POINT_SUBSCRIBE
 	FIND_DEW_POINT,
 	FIND_DEW_POINT_CCC,
 #endif
@@ -67,6 +124,9 @@ enum handle_status_t {
 	FIND_BATTERY_LEVEL,
 	FIND_BATTERY_LEVEL_CCC,
 #endif
+	/* The first subscription step has the same value as DISCOVERY_COMPLETE */
+	DISCOVERY_COMPLETE,
+	DISCOVERY_LAST_STEP = (DISCOVERY_COMPLETE - 1),
 #ifdef CONFIG_APP_ESS_TEMPERATURE
 	SUBSCRIBE_TEMPERATURE,
 #endif
@@ -76,7 +136,7 @@ enum handle_status_t {
 #ifdef CONFIG_APP_ESS_PRESSURE
 	SUBSCRIBE_PRESSURE,
 #endif
-#ifdef CONFIG_APP_ESS_DEW_POINT
+#ifdef CONFIG_APP_ESS_DEW_POINT_SUBSCRIBE
 	SUBSCRIBE_DEW_POINT,
 #endif
 #ifdef CONFIG_APP_BATTERY_LEVEL
@@ -121,6 +181,8 @@ enum readings_received_t {
 			0),
 };
 
+#define READING_FIELDS 5
+
 struct device_handles {
 	enum handle_status_t status;
 	uint16_t service;
@@ -134,7 +196,7 @@ struct device_handles {
 #ifdef CONFIG_APP_ESS_PRESSURE
 	struct bt_gatt_subscribe_params pressure;
 #endif
-#ifdef CONFIG_APP_ESS_DEW_POINT
+#ifdef CONFIG_APP_ESS_DEW_POINT_SUBSCRIBE
 	struct bt_gatt_subscribe_params dew_point;
 #endif
 #ifdef CONFIG_APP_BATTERY_LEVEL
@@ -159,20 +221,122 @@ struct device_readings {
 	uint8_t battery_level;
 #endif
 	enum readings_received_t received;
+	int64_t received_time[READING_FIELDS]; /* Uptime each reading was received at, by bit index */
+};
+
+/* Copy of the readings published for readers, sequence is odd whilst it is being updated */
+struct device_snapshot {
+	atomic_t sequence;
+	struct device_readings readings;
+};
+
+#define DEVICE_SLOTS CONFIG_APP_DEVICE_SLOTS
+
+/* Links left for connecting to devices once the GATT server has its peripheral link */
+#ifdef CONFIG_APP_GATT_SERVER
+#define CENTRAL_LINKS_MAX (CONFIG_BT_MAX_CONN - 1)
+#else
+#define CENTRAL_LINKS_MAX CONFIG_BT_MAX_CONN
+#endif
+
+/* Devices stay connected unless polling, so without it the roster only holds as many as there
+ * are links for
+ */
+#ifdef CONFIG_APP_POLLING
+#define ROSTER_DEVICES_MAX DEVICE_SLOTS
+#else
+#define ROSTER_DEVICES_MAX MIN(DEVICE_SLOTS, CENTRAL_LINKS_MAX)
+#endif
+#define DEVICE_NAME_MAX 18
+
+struct device_stats {
+	uint16_t connections;
+	uint16_t failures;
+	uint16_t disconnects;
+	uint16_t timeouts;
+	uint16_t link_losses; /* Disconnects due to supervision timeout */
+#ifdef CONFIG_APP_TX_POWER
+	int32_t rssi_total;
+	uint32_t rssi_samples;
+	int8_t rssi_min;
+#endif
+	int64_t first_reading; /* Uptime of the first complete set of readings, 0 before it */
+};
+
+#ifdef CONFIG_APP_HANDLE_CACHE
+/* Handles found by discovery, kept in settings so that discovery can be skipped after a reboot.
+ * Handles are indexed by reading bit
+ */
+struct handle_cache {
+	uint16_t service;
+	uint16_t battery_service;
+	uint16_t value_handle[READING_FIELDS];
+	uint16_t ccc_handle[READING_FIELDS];
+};
+#endif
+
+#ifdef CONFIG_APP_CONN_PLANNER
+/* Interval of a link in the connection plan, the base interval times 2^exponent */
+struct link_plan {
+	bool planned;
+	uint8_t exponent;
+	uint16_t interval; /* Interval the controller reports, 1.25 ms units */
 };
+#endif
 
 struct device_params {
 	bt_addr_le_t address;
 	enum device_state_t state;
 	struct bt_conn *connection;
 	struct device_handles handles;
-	struct device_readings readings;
-	const char *name;
+	struct device_readings readings; /* Only accessed from the BT RX context */
+	struct device_snapshot snapshot;
+	struct device_stats stats;
+	char name[DEVICE_NAME_MAX + 1];
+#ifdef CONFIG_APP_POLLING
+	int64_t poll_due; /* Uptime the next poll can start at */
+#endif
+#if defined(CONFIG_APP_POLLING) || defined(CONFIG_APP_HANDLE_CACHE)
+	bool handles_cached; /* Handles of a previous connection are reused, skipping discovery */
+#endif
+#ifdef CONFIG_APP_HANDLE_CACHE
+	struct handle_cache cache;
+#endif
+#ifdef CONFIG_APP_TX_POWER
+	int8_t rssi; /* Latest RSSI of the connection, RSSI_UNKNOWN until sampled */
+	int8_t tx_power; /* TX power of the connection in dBm */
+#endif
+#ifdef CONFIG_APP_ADAPTIVE_PHY
+	enum phy_policy_t phy_policy;
+	uint8_t phy; /* BT_GAP_LE_PHY_* of the current or last connection, 0 before the first */
+	uint8_t failure_streak; /* Failed connections or setups since the last success */
+#endif
+#ifdef CONFIG_APP_CONN_PLANNER
+	struct link_plan plan;
+#endif
+#ifdef CONFIG_APP_EATT
+	bool eatt_unavailable; /* No enhanced bearers on an earlier connection, so none are awaited */
+#endif
 };
 
+/* Packed readings of a device, readings which are disabled or have not been received are 0 */
+struct packed_readings {
+	uint8_t device;
+	uint8_t received;
+	int16_t temperature; /* 0.01 degrees C */
+	uint16_t humidity; /* 0.01 % */
+	uint32_t pressure; /* 0.1 Pa */
+	int8_t dew_point; /* Degrees C */
+	uint8_t battery_level; /* % */
+	uint16_t age; /* Seconds since the oldest reading was received */
+} __packed;
+
+/* Host decoders are written from the record size in the Kconfig help */
+BUILD_ASSERT(sizeof(struct packed_readings) == 14, "Packed readings record is not 14 bytes");
+
 static const uint8_t device_id_value_offset = 1;
 
-static struct device_params devices[3] = {
+static struct device_params devices[DEVICE_SLOTS] = {
 	{
 		.address = {
 			.type = BT_ADDR_LE_RANDOM,
@@ -196,20 +360,55 @@ static struct device_params devices[3] = {
 	},
 };
 
-#define DEVICE_COUNT ARRAY_SIZE(devices)
+static uint8_t device_count = 3; /* Number of devices in the roster */
 static uint8_t current_index = 0;
 static bool disabled = false; /* If true, prevents connecting to sensors */
 static bool busy = false; /* If true, application is busy connecting/subscribing to a device and will wait before connecting to next device */
+static bool scanning = false; /* If true, a scan is running and no new connections will be made */
+static bool bluetooth_ready = false; /* Bluetooth and the roster are ready, connecting can start */
+static atomic_t boot_pending = ATOMIC_INIT(2); /* Bluetooth and the roster still to be ready */
 
 static struct bt_uuid_16 uuid = BT_UUID_INIT_16(0);
 static struct bt_gatt_discover_params discover_params;
 static struct k_sem next_action_sem;
-static struct k_sem fan_sem;
 
 K_THREAD_STACK_DEFINE(sensor_thread_stack, SENSOR_THREAD_STACK_SIZE);
 static k_tid_t sensor_thread_id;
 static struct k_thread sensor_thread;
+
+K_THREAD_STACK_DEFINE(pipeline_thread_stack, PIPELINE_THREAD_STACK_SIZE);
+static k_tid_t pipeline_thread_id;
+static struct k_thread pipeline_thread;
+
+/* Connection state machine work runs here so that it is not held up by the system workqueue */
+K_THREAD_STACK_DEFINE(bt_work_stack, BT_WORK_STACK_SIZE);
+static struct k_work_q bt_work_q;
 static struct k_work subscribe_workqueue;
+#ifdef CONFIG_APP_STATE_WATCHDOG
+static struct k_work_delayable state_watchdog;
+#endif
+#ifdef CONFIG_APP_TX_POWER
+static struct k_work_delayable tx_power_work;
+#endif
+#ifdef CONFIG_APP_POLLING
+static struct k_work_delayable poll_deadline;
+
+struct poll_read {
+	struct bt_gatt_read_params params;
+	struct bt_gatt_subscribe_params *subscription; /* Reading being read */
+};
+
+static struct poll_read poll_reads[READING_FIELDS];
+#endif
+#ifdef CONFIG_APP_EATT
+#define EATT_WAIT_POLL_MS 50
+
+static atomic_t batch_pending; /* Requests of a batch still outstanding, 0 when not batching */
+static int64_t eatt_deadline; /* Uptime to stop waiting for enhanced bearers at, 0 once stopped */
+static bool eatt_failed = false; /* Encryption failed, so no enhanced bearers will follow */
+static bool eatt_waiting = false;
+static struct k_work_delayable eatt_wait_work;
+#endif
 
 K_THREAD_STACK_DEFINE(fan_thread_stack, FAN_THREAD_STACK_SIZE);
 static k_tid_t fan_thread_id;
@@ -217,7 +416,54 @@ static struct k_thread fan_thread;
 
 static const char tick_character[] = {0xe2, 0x9c, 0x93, 0x00};
 
+/* Uptime readings were last output by the shell, used to only output each set once */
+static int64_t shell_readings_output[DEVICE_SLOTS];
+
 static bool pwm_enabled = true;
+
+enum fan_curve {
+	FAN_CURVE_LINEAR,
+	FAN_CURVE_S,
+	FAN_CURVE_SOFT,
+
+	FAN_CURVE_COUNT,
+};
+
+static const char * const fan_curve_names[FAN_CURVE_COUNT] = {
+	"linear",
+	"scurve",
+	"soft",
+};
+
+#if defined(CONFIG_APP_FAN_CURVE_S)
+#define FAN_CURVE_DEFAULT FAN_CURVE_S
+#elif defined(CONFIG_APP_FAN_CURVE_SOFT)
+#define FAN_CURVE_DEFAULT FAN_CURVE_SOFT
+#else
+#define FAN_CURVE_DEFAULT FAN_CURVE_LINEAR
+#endif
+
+/* Requested fan speed, published by the shell and consumed by the fan thread */
+struct fan_request {
+	uint8_t speed;
+	bool half;
+	uint8_t slew_rate; /* Percent per second, 0 to change immediately */
+	enum fan_curve curve;
+};
+
+/* Ramp in progress in the fan thread, restarted from the current speed on each request */
+struct fan_ramp {
+	uint8_t start;
+	int64_t started;
+	uint32_t duration;
+	enum fan_curve curve;
+};
+
+ZBUS_SUBSCRIBER_DEFINE(fan_subscriber, 4);
+ZBUS_CHAN_DEFINE(fan_chan, struct fan_request, NULL, NULL, ZBUS_OBSERVERS(fan_subscriber),
+		 ZBUS_MSG_INIT(.speed = 0, .half = false, .slew_rate = CONFIG_APP_FAN_SLEW_RATE,
+			       .curve = FAN_CURVE_DEFAULT));
+
 static uint8_t fan_speed = 0;
 static uint8_t current_fan_speed = 0;
 static bool half_fan_speed = false;
@@ -228,1142 +474,5954 @@ static const struct pwm_dt_spec fan_pwm = PWM_DT_SPEC_GET(DT_NODELABEL(fan_pwm))
 static const struct gpio_dt_spec reset = GPIO_DT_SPEC_GET(DT_NODELABEL(reset_pin), gpios);
 static const struct gpio_dt_spec fan_pin = GPIO_DT_SPEC_GET(DT_NODELABEL(fan_pin), gpios);
 static bool last_dht_reading_pass = false;
+static struct device_readings local_readings; /* Protected by local_lock */
+static struct device_snapshot local_snapshot;
+static K_MUTEX_DEFINE(local_lock);
 static uint8_t connection_failures = 0;
+static bool time_synced = false;
+static int64_t epoch_offset = 0; /* Offset to add to uptime to get epoch time in ms */
+static int64_t local_first_reading = 0; /* Uptime of the first local sample, 0 before it */
 
-static uint8_t notify_func(struct bt_conn *conn, struct bt_gatt_subscribe_params *params,
-			   const void *data, uint16_t length)
+#define LOCAL_WARMUP_SAMPLES 3
+#define LOCAL_WARMUP_INTERVAL_MS 1200
+
+static struct k_work_delayable local_warmup_work;
+static uint8_t local_warmup_count = 0;
+
+static void reading_received(struct device_readings *readings, enum readings_received_t field)
 {
-	uint8_t i = 0;
+	readings->received |= field;
+	readings->received_time[find_lsb_set(field) - 1] = k_uptime_get();
+}
 
-	if (!data) {
-		LOG_ERR("[UNSUBSCRIBED]");
-		params->value_handle = 0U;
-		return BT_GATT_ITER_STOP;
-	}
+/* Returns uptime of the oldest reading in a set */
+static int64_t readings_oldest(const struct device_readings *readings)
+{
+	uint8_t i = 0;
+	int64_t oldest = INT64_MAX;
 
-	while (i < DEVICE_COUNT) {
-		if (devices[i].connection == conn) {
-			break;
+	while (i < READING_FIELDS) {
+		if ((readings->received & BIT(i)) && readings->received_time[i] < oldest) {
+			oldest = readings->received_time[i];
 		}
+
 		++i;
 	}
 
-	if (i == DEVICE_COUNT) {
-		LOG_ERR("ERROR! INVALID CONNECTION!");
-		return BT_GATT_ITER_STOP;
+	return oldest;
+}
+
+/* Returns true if all readings have been received, and if max_age is not 0, that they
+ * were received within max_age milliseconds
+ */
+static bool readings_fresh(const struct device_readings *readings, int64_t max_age)
+{
+	if (readings->received != RECEIVED_ALL) {
+		return false;
 	}
 
-	LOG_ERR("[NOTIFICATION] from %d data %p length %u", i, data, length);
-//	LOG_HEXDUMP_ERR(data, length, "Value");
+	if (max_age == 0) {
+		return true;
+	}
 
-	if (0) {
-#ifdef CONFIG_APP_ESS_TEMPERATURE
-	} else if (params == &devices[i].handles.temperature) {
-		uint16_t value;
-		double fp_value;
+	return ((k_uptime_get() - readings_oldest(readings)) <= max_age);
+}
 
-		value = sys_get_le16(&((uint8_t *)data)[0]);
-		fp_value = ((double)value) / 100.0;
+/* Publishes readings to a snapshot, there must only be one writer of a snapshot at a time and it
+ * must not be preempted by a reader
+ */
+static void snapshot_write(struct device_snapshot *snapshot, const struct device_readings *readings)
+{
+	atomic_inc(&snapshot->sequence);
+	barrier_dmem_fence_full();
+	memcpy(&snapshot->readings, readings, sizeof(struct device_readings));
+	barrier_dmem_fence_full();
+	atomic_inc(&snapshot->sequence);
+}
 
-		devices[i].readings.temperature = fp_value;
-		devices[i].readings.received |= RECEIVED_TEMPERATURE;
-LOG_ERR("temp = %fc", fp_value);
-#endif
-#ifdef CONFIG_APP_ESS_HUMIDITY
-	} else if (params == &devices[i].handles.humidity) {
-		uint16_t value;
-		double fp_value;
+/* Gets a consistent copy of a snapshot without blocking the writer, returns the sequence number
+ * of the copy
+ */
+static atomic_val_t snapshot_read(struct device_snapshot *snapshot, struct device_readings *readings)
+{
+	atomic_val_t sequence;
 
-		value = sys_get_le16(&((uint8_t *)data)[0]);
-		fp_value = ((double)value) / 100.0;
+	do {
+		sequence = atomic_get(&snapshot->sequence);
 
-		devices[i].readings.humidity = fp_value;
-		devices[i].readings.received |= RECEIVED_HUMIDITY;
+		if (sequence & 1) {
+			/* Update in progress */
+			k_yield();
+			continue;
+		}
 
-LOG_ERR("hum = %f%c", fp_value, '%');
+		memcpy(readings, &snapshot->readings, sizeof(struct device_readings));
+		barrier_dmem_fence_full();
+	} while ((sequence & 1) || atomic_get(&snapshot->sequence) != sequence);
+
+	return sequence;
+}
+
+/* Publishes the working readings of a device, must only be called from the BT RX context */
+static void readings_publish(uint8_t index)
+{
+	snapshot_write(&devices[index].snapshot, &devices[index].readings);
+}
+
+static atomic_val_t readings_get(uint8_t index, struct device_readings *readings)
+{
+	return snapshot_read(&devices[index].snapshot, readings);
+}
+
+#if defined(CONFIG_APP_TELEMETRY) || defined(CONFIG_APP_GATT_SERVER) || \
+	defined(CONFIG_APP_BROADCAST) || defined(CONFIG_APP_HISTORY)
+/* Returns true if every reading has been received since the time pointed to by last_output,
+ * and if so updates it to the current time. Used by consumers of readings to output each set
+ * once
+ */
+static bool readings_new_set(const struct device_readings *readings, int64_t *last_output)
+{
+	if (readings->received != RECEIVED_ALL || readings_oldest(readings) <= *last_output) {
+		return false;
+	}
+
+	*last_output = k_uptime_get();
+
+	return true;
+}
 #endif
-#ifdef CONFIG_APP_ESS_PRESSURE
-	} else if (params == &devices[i].handles.pressure) {
-		uint32_t value;
-		double fp_value;
 
-		value = sys_get_le32(&((uint8_t *)data)[0]);
-		fp_value = (double)value;
+#if defined(CONFIG_APP_GATT_SERVER) || defined(CONFIG_APP_BROADCAST) || \
+	defined(CONFIG_APP_HISTORY)
+/* Packs readings into little-endian wire format */
+static void readings_pack(uint8_t index, const struct device_readings *readings,
+			  struct packed_readings *packed)
+{
+	int64_t age = UINT16_MAX;
 
-		devices[i].readings.pressure = fp_value;
-		devices[i].readings.received |= RECEIVED_PRESSURE;
+	memset(packed, 0, sizeof(struct packed_readings));
+	packed->device = device_id_value_offset + index;
+	packed->received = (uint8_t)readings->received;
 
-LOG_ERR("press = %fPa", fp_value);
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+	packed->temperature = sys_cpu_to_le16((int16_t)lround(readings->temperature * 100.0));
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+	packed->humidity = sys_cpu_to_le16((uint16_t)lround(readings->humidity * 100.0));
+#endif
+#ifdef CONFIG_APP_ESS_PRESSURE
+	packed->pressure = sys_cpu_to_le32((uint32_t)readings->pressure);
 #endif
 #ifdef CONFIG_APP_ESS_DEW_POINT
-	} else if (params == &devices[i].handles.dew_point) {
-		devices[i].readings.dew_point = ((int8_t *)data)[0];
-		devices[i].readings.received |= RECEIVED_DEW_POINT;
-
-LOG_ERR("dew = %dc", ((int8_t *)data)[0]);
+	packed->dew_point = readings->dew_point;
 #endif
 #ifdef CONFIG_APP_BATTERY_LEVEL
-	} else if (params == &devices[i].handles.battery_level) {
-		devices[i].readings.battery_level = ((int8_t *)data)[0];
-		devices[i].readings.received |= RECEIVED_BATTERY_LEVEL;
-
-LOG_ERR("battery = %u%c", ((uint8_t *)data)[0], '%');
+	packed->battery_level = readings->battery_level;
 #endif
-	} else {
-LOG_ERR("not valid");
+
+	if (readings->received != RECEIVED_NONE) {
+		age = MIN((k_uptime_get() - readings_oldest(readings)) / MSEC_PER_SEC, UINT16_MAX);
 	}
 
-	return BT_GATT_ITER_CONTINUE;
+	packed->age = sys_cpu_to_le16((uint16_t)age);
 }
+#endif
 
-static void subscribe_func(struct bt_conn *conn, uint8_t err,
-			   struct bt_gatt_subscribe_params *params)
+#ifdef CONFIG_APP_BROADCAST
+#define BROADCAST_COMPANY_ID 0xffff
+#define BROADCAST_VERSION 1
+
+#ifdef CONFIG_BT_CTLR_ADV_DATA_LEN_MAX
+#define BROADCAST_DATA_LEN_MAX CONFIG_BT_CTLR_ADV_DATA_LEN_MAX
+#else
+/* Length set by overlay-broadcast.conf, for controllers without the option */
+#define BROADCAST_DATA_LEN_MAX 191
+#endif
+
+#define BROADCAST_AD_HEADER_SIZE 2 /* Length and type of the AD structure */
+#define BROADCAST_PAYLOAD_HEADER_SIZE 3 /* Company ID and version */
+
+/* Maximum number of rows which fit in the advertising data */
+#define BROADCAST_ROWS MIN((DEVICE_SLOTS + 1), \
+			   ((BROADCAST_DATA_LEN_MAX - BROADCAST_AD_HEADER_SIZE - \
+			     BROADCAST_PAYLOAD_HEADER_SIZE) / sizeof(struct packed_readings)))
+
+/* Manufacturer specific data of the broadcast, rows of devices followed by the local sensor */
+struct broadcast_payload {
+	uint16_t company_id;
+	uint8_t version;
+	struct packed_readings rows[BROADCAST_ROWS];
+} __packed;
+
+BUILD_ASSERT((sizeof(struct broadcast_payload) + BROADCAST_AD_HEADER_SIZE) <=
+	     BROADCAST_DATA_LEN_MAX, "Broadcast rows do not fit in the advertising data");
+
+static struct bt_le_ext_adv *broadcast_set;
+static struct broadcast_payload broadcast_payload;
+static int64_t broadcast_readings_output[DEVICE_SLOTS];
+static struct k_work broadcast_work;
+
+/* Refreshes the advertising data with the latest snapshot of every device */
+static void broadcast_update(struct k_work *work)
 {
-	if (err) {
-		int err;
+	struct device_readings readings;
+	struct bt_data ad;
+	uint8_t i = 0;
+	int err;
 
-		LOG_ERR("Gonna matey");
-		err = bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
-	} else {
-		k_work_submit(&subscribe_workqueue);
+	if (broadcast_set == NULL) {
+		return;
+	}
+
+	broadcast_payload.company_id = sys_cpu_to_le16(BROADCAST_COMPANY_ID);
+	broadcast_payload.version = BROADCAST_VERSION;
+
+	while (i < device_count && i < (BROADCAST_ROWS - 1)) {
+		(void)readings_get(i, &readings);
+		readings_pack(i, &readings, &broadcast_payload.rows[i]);
+		++i;
+	}
+
+	(void)snapshot_read(&local_snapshot, &readings);
+	readings_pack(device_count, &readings, &broadcast_payload.rows[i]);
+	++i;
+
+	ad.type = BT_DATA_MANUFACTURER_DATA;
+	ad.data_len = offsetof(struct broadcast_payload, rows) + (i * sizeof(struct packed_readings));
+	ad.data = (const uint8_t *)&broadcast_payload;
+
+#ifdef CONFIG_APP_BROADCAST_PERIODIC
+	err = bt_le_per_adv_set_data(broadcast_set, &ad, 1);
+#else
+	err = bt_le_ext_adv_set_data(broadcast_set, &ad, 1, NULL, 0);
+#endif
+
+	if (err) {
+		LOG_ERR("Broadcast data update failed (err %d)", err);
 	}
 }
 
-static void next_action(struct bt_conn *conn, const struct bt_gatt_attr *attr)
+static int broadcast_start(void)
 {
 	int err;
-	uint8_t action = 0;
-	uint8_t service = 0;
-	struct bt_gatt_subscribe_params *param = NULL;
 
-	/* Increment to next state */
-	++devices[current_index].handles.status;
+	err = bt_le_ext_adv_create(BT_LE_EXT_ADV_NCONN, NULL, &broadcast_set);
 
-	if (devices[current_index].handles.status == AWAITING_READINGS) {
-		/* Finished the setup state machine */
-		LOG_ERR("All finished!");
-		busy = false;
-		devices[current_index].state = STATE_ACTIVE;
-		devices[current_index].handles.status = AWAITING_READINGS;
-		k_sem_give(&next_action_sem);
-		return;
+	if (err) {
+		return err;
 	}
 
-	switch (devices[current_index].handles.status) {
-#ifdef CONFIG_APP_ESS_TEMPERATURE
-		case FIND_TEMPERATURE:
-		{
-			memcpy(&uuid, BT_UUID_TEMPERATURE, sizeof(uuid));
-			break;
-		}
-#endif
-#ifdef CONFIG_APP_ESS_HUMIDITY
-		case FIND_HUMIDITY:
-		{
-			memcpy(&uuid, BT_UUID_HUMIDITY, sizeof(uuid));
-			break;
-		}
-#endif
-#ifdef CONFIG_APP_ESS_PRESSURE
-		case FIND_PRESSURE:
-		{
-			memcpy(&uuid, BT_UUID_PRESSURE, sizeof(uuid));
-			break;
-		}
+#ifdef CONFIG_APP_BROADCAST_PERIODIC
+	err = bt_le_per_adv_set_param(broadcast_set, BT_LE_PER_ADV_DEFAULT);
+
+	if (!err) {
+		err = bt_le_per_adv_start(broadcast_set);
+	}
+
+	if (err) {
+		return err;
+	}
 #endif
-#ifdef CONFIG_APP_ESS_DEW_POINT
-		case FIND_DEW_POINT:
-		{
-			memcpy(&uuid, BT_UUID_DEW_POINT, sizeof(uuid));
-			break;
-		}
+
+	broadcast_update(NULL);
+
+	return bt_le_ext_adv_start(broadcast_set, BT_LE_EXT_ADV_START_DEFAULT);
+}
 #endif
-#ifdef CONFIG_APP_BATTERY_LEVEL
-		case FIND_BATTERY_SERVICE:
-		{
-			memcpy(&uuid, BT_UUID_BAS, sizeof(uuid));
-			action = 1;
-			break;
+
+#ifdef CONFIG_APP_GATT_SERVER
+#define BT_UUID_AGGREGATE_SERVICE_VAL \
+	BT_UUID_128_ENCODE(0x2b9e0000, 0x8d3c, 0x4c7a, 0x9a61, 0x5f0e3c2d1b00)
+#define BT_UUID_AGGREGATE_READINGS_VAL \
+	BT_UUID_128_ENCODE(0x2b9e0001, 0x8d3c, 0x4c7a, 0x9a61, 0x5f0e3c2d1b00)
+
+static const struct bt_uuid_128 aggregate_service_uuid =
+	BT_UUID_INIT_128(BT_UUID_AGGREGATE_SERVICE_VAL);
+static const struct bt_uuid_128 aggregate_readings_uuid =
+	BT_UUID_INIT_128(BT_UUID_AGGREGATE_READINGS_VAL);
+
+static const struct bt_data server_ad[] = {
+	BT_DATA_BYTES(BT_DATA_FLAGS, (BT_LE_AD_GENERAL | BT_LE_AD_NO_BREDR)),
+	BT_DATA_BYTES(BT_DATA_UUID128_ALL, BT_UUID_AGGREGATE_SERVICE_VAL),
+};
+
+static const struct bt_data server_sd[] = {
+	BT_DATA(BT_DATA_NAME_COMPLETE, CONFIG_BT_DEVICE_NAME, (sizeof(CONFIG_BT_DEVICE_NAME) - 1)),
+};
+
+static atomic_t server_pending = ATOMIC_INIT(0); /* Bitmask of rows to notify, by device index */
+static int64_t server_readings_output[DEVICE_SLOTS];
+static struct k_work server_notify_work;
+static struct k_work server_advertise_work;
+
+/* Reads the rows of all devices, followed by the local sensor row */
+static ssize_t server_readings_read(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+				    void *buf, uint16_t len, uint16_t offset)
+{
+	struct packed_readings rows[DEVICE_SLOTS + 1];
+	struct device_readings readings;
+	uint8_t i = 0;
+
+	while (i < device_count) {
+		(void)readings_get(i, &readings);
+		readings_pack(i, &readings, &rows[i]);
+		++i;
+	}
+
+	(void)snapshot_read(&local_snapshot, &readings);
+	readings_pack(i, &readings, &rows[i]);
+
+	return bt_gatt_attr_read(conn, attr, buf, len, offset, rows,
+				 ((i + 1) * sizeof(struct packed_readings)));
+}
+
+BT_GATT_SERVICE_DEFINE(aggregate_service,
+	BT_GATT_PRIMARY_SERVICE(&aggregate_service_uuid),
+	BT_GATT_CHARACTERISTIC(&aggregate_readings_uuid.uuid, BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY,
+			       BT_GATT_PERM_READ, server_readings_read, NULL, NULL),
+	BT_GATT_CCC(NULL, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+);
+
+/* Notifies subscribed clients of the row of each device with new readings */
+static void server_notify(struct k_work *work)
+{
+	atomic_val_t pending = atomic_clear(&server_pending);
+	struct device_readings readings;
+	struct packed_readings row;
+	uint8_t i = 0;
+
+	while (i < device_count) {
+		if (pending & BIT(i)) {
+			(void)readings_get(i, &readings);
+			readings_pack(i, &readings, &row);
+			(void)bt_gatt_notify(NULL, &aggregate_service.attrs[1], &row, sizeof(row));
 		}
-		case FIND_BATTERY_LEVEL:
-		{
-			memcpy(&uuid, BT_UUID_BAS_BATTERY_LEVEL, sizeof(uuid));
-			service = 1;
-			break;
+
+		++i;
+	}
+
+	if (pending & BIT(DEVICE_SLOTS)) {
+		(void)snapshot_read(&local_snapshot, &readings);
+		readings_pack(device_count, &readings, &row);
+		(void)bt_gatt_notify(NULL, &aggregate_service.attrs[1], &row, sizeof(row));
+	}
+}
+
+/* Queues a notification for a row, index of DEVICE_SLOTS is the local sensor */
+static void server_readings_updated(uint8_t index)
+{
+	atomic_set_bit(&server_pending, index);
+	k_work_submit(&server_notify_work);
+}
+
+static void server_advertise(struct k_work *work)
+{
+	int err = bt_le_adv_start(BT_LE_ADV_CONN_FAST_1, server_ad, ARRAY_SIZE(server_ad),
+				  server_sd, ARRAY_SIZE(server_sd));
+
+	if (err && err != -EALREADY) {
+		LOG_ERR("Advertising failed to start (err %d)", err);
+	}
+}
+
+/* Returns true if the connection is from a client of the GATT server */
+static bool server_connection(struct bt_conn *conn)
+{
+	struct bt_conn_info info;
+
+	return (bt_conn_get_info(conn, &info) == 0 && info.role == BT_CONN_ROLE_PERIPHERAL);
+}
+
+static void recycled(void)
+{
+	/* A connection object is free again, resume advertising if a client disconnected */
+	k_work_submit(&server_advertise_work);
+}
+#endif
+
+#if defined(CONFIG_APP_AGGREGATES) || defined(CONFIG_APP_ALARMS)
+static const char *const field_names[READING_FIELDS] = {
+	"temperature", "humidity", "pressure", "dewpoint", "battery",
+};
+#endif
+
+#ifdef CONFIG_APP_AGGREGATES
+#define AGGREGATE_WINDOWS 3
+
+struct aggregate_result {
+	int64_t end;
+	float min;
+	float max;
+	float mean;
+	float stddev;
+	uint16_t count;
+};
+
+struct aggregate_window {
+	/* Totals of the window in progress are relative to its first value to limit rounding */
+	int64_t start;
+	float shift;
+	float sum;
+	float sum_squares;
+	float min;
+	float max;
+	uint16_t count;
+	struct aggregate_result completed;
+};
+
+static const uint32_t aggregate_windows[AGGREGATE_WINDOWS] = {
+	CONFIG_APP_AGGREGATE_WINDOW_1,
+	CONFIG_APP_AGGREGATE_WINDOW_2,
+	CONFIG_APP_AGGREGATE_WINDOW_3,
+};
+
+/* Indexed by device, with the local sensor at DEVICE_SLOTS, then by reading bit index */
+static struct aggregate_window aggregates[DEVICE_SLOTS + 1][READING_FIELDS][AGGREGATE_WINDOWS];
+static K_MUTEX_DEFINE(aggregate_lock);
+
+/* Completes the window in progress if its period has elapsed. Sums are kept as float so that
+ * they use the FPU rather than soft double
+ */
+static void aggregate_expire(struct aggregate_window *window, uint8_t number, int64_t now)
+{
+	int64_t length = (int64_t)aggregate_windows[number] * MSEC_PER_SEC;
+	float mean;
+	float variance;
+
+	if (window->count == 0 || (now - window->start) < length) {
+		return;
+	}
+
+	mean = window->sum / window->count;
+	variance = (window->sum_squares / window->count) - (mean * mean);
+
+	window->completed.end = window->start + length;
+	window->completed.min = window->min;
+	window->completed.max = window->max;
+	window->completed.mean = window->shift + mean;
+	window->completed.stddev = sqrtf(variance > 0.0f ? variance : 0.0f);
+	window->completed.count = window->count;
+	window->count = 0;
+}
+
+static void aggregate_add(uint8_t index, enum readings_received_t field, double reading)
+{
+	uint8_t bit = find_lsb_set(field) - 1;
+	int64_t now = k_uptime_get();
+	float value = (float)reading;
+	uint8_t i = 0;
+
+	k_mutex_lock(&aggregate_lock, K_FOREVER);
+
+	while (i < AGGREGATE_WINDOWS) {
+		struct aggregate_window *window = &aggregates[index][bit][i];
+		float difference;
+
+		aggregate_expire(window, i, now);
+
+		if (window->count == 0) {
+			window->start = now;
+			window->shift = value;
+			window->sum = 0.0f;
+			window->sum_squares = 0.0f;
+			window->min = value;
+			window->max = value;
+		}
+
+		difference = value - window->shift;
+		window->sum += difference;
+		window->sum_squares += (difference * difference);
+
+		if (value < window->min) {
+			window->min = value;
+		} else if (value > window->max) {
+			window->max = value;
+		}
+
+		if (window->count < UINT16_MAX) {
+			++window->count;
+		}
+
+		++i;
+	}
+
+	k_mutex_unlock(&aggregate_lock);
+}
+
+/* Gets the statistics of the last completed window */
+static void aggregate_get(uint8_t index, uint8_t bit, uint8_t number, struct aggregate_result *result)
+{
+	k_mutex_lock(&aggregate_lock, K_FOREVER);
+	aggregate_expire(&aggregates[index][bit][number], number, k_uptime_get());
+	memcpy(result, &aggregates[index][bit][number].completed, sizeof(struct aggregate_result));
+	k_mutex_unlock(&aggregate_lock);
+}
+#endif
+
+#if defined(CONFIG_APP_ESS_DEW_POINT) && defined(CONFIG_APP_ESS_TEMPERATURE) && \
+    defined(CONFIG_APP_ESS_HUMIDITY)
+/* Calculates the dew point in degrees C using the Magnus formula (a = 17.62, b = 243.12 C) in
+ * Q16 fixed point, the natural log of the humidity comes from a quadratic fit of log2 over
+ * each power of 2 which is within 0.15 C of the floating point result between -40-60 C
+ */
+static int8_t dew_point_calculate(double temperature, double humidity)
+{
+	int32_t centi_temperature = (int32_t)(temperature * 100.0);
+	int32_t centi_humidity = (int32_t)(humidity * 100.0);
+	int32_t exponent;
+	int32_t fraction;
+	int64_t log2_value;
+	int64_t gamma;
+	int64_t dew_point;
+
+	centi_humidity = CLAMP(centi_humidity, 1, 10000);
+	centi_temperature = CLAMP(centi_temperature, -10000, 10000);
+
+	/* log2(1 + f) ~= f + 0.3465 * f * (1 - f) */
+	exponent = find_msb_set(centi_humidity) - 1;
+	fraction = (int32_t)((((uint32_t)centi_humidity) << 16) >> exponent) - 65536;
+	log2_value = ((int64_t)exponent * 65536) + fraction +
+		     (((((int64_t)fraction * (65536 - fraction)) >> 16) * 22708) >> 16);
+
+	/* gamma = ln(RH / 100%) + a * T / (b + T), with ln(2) = 45426 and ln(10000) = 603609 */
+	gamma = ((log2_value * 45426) >> 16) - 603609;
+	gamma += ((int64_t)1762 * centi_temperature * 65536) / (100 * (24312 + centi_temperature));
+
+	/* Td = b * gamma / (a - gamma), a = 1154744 */
+	dew_point = ((int64_t)24312 * gamma) / (1154744 - gamma);
+	dew_point += (dew_point < 0 ? -50 : 50);
+
+	return (int8_t)CLAMP(dew_point / 100, INT8_MIN, INT8_MAX);
+}
+
+/* Updates the dew point of readings which have both temperature and humidity, returns true if
+ * it was updated
+ */
+static bool dew_point_update(struct device_readings *readings)
+{
+	if ((readings->received & (RECEIVED_TEMPERATURE | RECEIVED_HUMIDITY)) !=
+	    (RECEIVED_TEMPERATURE | RECEIVED_HUMIDITY)) {
+		return false;
+	}
+
+	readings->dew_point = dew_point_calculate(readings->temperature, readings->humidity);
+	reading_received(readings, RECEIVED_DEW_POINT);
+
+	return true;
+}
+#endif
+
+/* Readings of a device published after each update, index of DEVICE_SLOTS is the local sensor.
+ * Producers only publish, the outputs, statistics and any other consumers observe the channel
+ */
+struct readings_message {
+	uint8_t index;
+	enum readings_received_t changed; /* Readings updated since the previous message */
+	struct device_readings readings;
+};
+
+#ifdef CONFIG_ZBUS_MSG_SUBSCRIBER_BUF_ALLOC_STATIC
+BUILD_ASSERT(sizeof(struct readings_message) <= CONFIG_ZBUS_MSG_SUBSCRIBER_NET_BUF_STATIC_DATA_SIZE,
+	     "zbus message buffers are too small for readings");
+#endif
+
+ZBUS_MSG_SUBSCRIBER_DEFINE(pipeline_subscriber);
+ZBUS_CHAN_DEFINE(readings_chan, struct readings_message, NULL, NULL,
+		 ZBUS_OBSERVERS(pipeline_subscriber), ZBUS_MSG_INIT(0));
+
+static atomic_t pipeline_dropped = ATOMIC_INIT(0);
+
+/* Publishes readings to the consumers, which process them on their own threads so that this
+ * never waits on them. Called from the BT RX context, so a message which cannot be queued
+ * straight away is dropped and counted rather than waited for
+ */
+static void pipeline_publish(uint8_t index, enum readings_received_t changed,
+			     const struct device_readings *readings)
+{
+	struct readings_message message;
+
+	message.index = index;
+	message.changed = changed;
+	memcpy(&message.readings, readings, sizeof(struct device_readings));
+
+	if (zbus_chan_pub(&readings_chan, &message, K_NO_WAIT) != 0) {
+		atomic_inc(&pipeline_dropped);
+	}
+}
+
+/* Fetches a sample from the local sensor and publishes it, returns 0 on success */
+static int local_sample(void)
+{
+	int err;
+	struct sensor_value value;
+	enum readings_received_t changed = RECEIVED_NONE;
+
+	k_mutex_lock(&local_lock, K_FOREVER);
+	err = sensor_sample_fetch(dht22);
+
+	if (!err) {
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+		(void)sensor_channel_get(dht22, SENSOR_CHAN_AMBIENT_TEMP, &value);
+		local_readings.temperature = sensor_value_to_double(&value);
+		reading_received(&local_readings, RECEIVED_TEMPERATURE);
+		changed |= RECEIVED_TEMPERATURE;
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+		(void)sensor_channel_get(dht22, SENSOR_CHAN_HUMIDITY, &value);
+		local_readings.humidity = sensor_value_to_double(&value);
+		reading_received(&local_readings, RECEIVED_HUMIDITY);
+		changed |= RECEIVED_HUMIDITY;
+#endif
+#if defined(CONFIG_APP_ESS_DEW_POINT) && defined(CONFIG_APP_ESS_TEMPERATURE) && \
+    defined(CONFIG_APP_ESS_HUMIDITY)
+		if (dew_point_update(&local_readings)) {
+			changed |= RECEIVED_DEW_POINT;
 		}
+#endif
+		/* Readers of the snapshot run at a higher priority and spin until the write is
+		 * done, so the shell or workqueue thread must not be preempted part way through
+		 */
+		k_sched_lock();
+		snapshot_write(&local_snapshot, &local_readings);
+		k_sched_unlock();
+		pipeline_publish(DEVICE_SLOTS, changed, &local_readings);
+
+		if (local_first_reading == 0) {
+			local_first_reading = k_uptime_get();
+		}
+	}
+
+	last_dht_reading_pass = (err ? false : true);
+	k_mutex_unlock(&local_lock);
+
+	return err;
+}
+
+/* Takes the first samples of the local sensor, which are mostly bogus, without holding up the
+ * rest of boot. Runs on the system workqueue, which bt_ready and history flushes share, so each
+ * sample holds those up for the length of a sensor fetch (a few ms for the DHT22)
+ */
+static void local_warmup(struct k_work *work)
+{
+	(void)local_sample();
+	++local_warmup_count;
+
+	if (local_warmup_count < LOCAL_WARMUP_SAMPLES) {
+		(void)k_work_schedule(&local_warmup_work, K_MSEC(LOCAL_WARMUP_INTERVAL_MS));
+	}
+}
+
+/* Returns true if the readings of a device are current, polling keeps them between connections */
+static bool device_reporting(uint8_t index)
+{
+#ifdef CONFIG_APP_POLLING
+	return true;
+#else
+	return (devices[index].state == STATE_ACTIVE);
+#endif
+}
+
+/* Converts an uptime to epoch time if the host has synced the time */
+static int64_t output_time(int64_t uptime)
+{
+	return (time_synced ? (uptime + epoch_offset) : uptime);
+}
+
+/* Readings of each device rendered in the output format when they are published, so that
+ * "ess readings" only has to join them. The timestamp is added on output as the host can sync
+ * the time after a row is rendered
+ */
+#define OUTPUT_ROW_HEAD_SIZE 40
+#define OUTPUT_ROW_FIELDS_SIZE 48
+#define OUTPUT_TIME_SIZE 21 /* Any int64_t and a comma */
+#define OUTPUT_LINE_SIZE (OUTPUT_ROW_HEAD_SIZE + OUTPUT_TIME_SIZE + OUTPUT_ROW_FIELDS_SIZE)
+
+struct output_row {
+	int64_t oldest; /* Uptime of the oldest reading, 0 without a complete set */
+	char head[OUTPUT_ROW_HEAD_SIZE]; /* Device number, address and name */
+	char fields[OUTPUT_ROW_FIELDS_SIZE];
+};
+
+static struct output_row output_rows[DEVICE_SLOTS];
+static struct k_spinlock output_rows_lock;
+
+/* Renders the row of a device, must only be called from the pipeline thread */
+static void output_row_update(uint8_t index, const struct device_readings *readings)
+{
+	struct output_row row = {0};
+	k_spinlock_key_t key;
+
+	if (readings->received == RECEIVED_ALL) {
+		row.oldest = readings_oldest(readings);
+
+#if defined(CONFIG_APP_OUTPUT_FORMAT_CUSTOM)
+		snprintf(row.head, sizeof(row.head), "%d,", index);
+		snprintf(row.fields, sizeof(row.fields), ""
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+			 "%.2f,"
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+			 "%.0f,"
+#endif
+#ifdef CONFIG_APP_ESS_PRESSURE
+			 "%.2f,"
+#endif
+#ifdef CONFIG_APP_ESS_DEW_POINT
+			 "%d,"
+#endif
+#ifdef CONFIG_APP_ESS_BATTERY_LEVEL
+			 "%d,"
 #endif
 #ifdef CONFIG_APP_ESS_TEMPERATURE
-		case FIND_TEMPERATURE_CCC:
+			 , readings->temperature
 #endif
 #ifdef CONFIG_APP_ESS_HUMIDITY
-		case FIND_HUMIDITY_CCC:
+			 , readings->humidity
 #endif
 #ifdef CONFIG_APP_ESS_PRESSURE
-		case FIND_PRESSURE_CCC:
+			 , readings->pressure
 #endif
 #ifdef CONFIG_APP_ESS_DEW_POINT
-		case FIND_DEW_POINT_CCC:
+			 , readings->dew_point
+#endif
+#ifdef CONFIG_APP_ESS_BATTERY_LEVEL
+			 , readings->battery_level
+#endif
+			 );
+#elif defined(CONFIG_APP_OUTPUT_FORMAT_CSV)
+		snprintf(row.head, sizeof(row.head), "%d,"
+#if defined(CONFIG_APP_OUTPUT_DEVICE_ADDRESS)
+			 "%02x%02x%02x%02x%02x%02x%02x,"
+#endif
+#if defined(CONFIG_APP_OUTPUT_DEVICE_NAME)
+			 "%s,"
+#endif
+			 , (device_id_value_offset + index)
+#if defined(CONFIG_APP_OUTPUT_DEVICE_ADDRESS)
+			 , devices[index].address.type, devices[index].address.a.val[5],
+			 devices[index].address.a.val[4], devices[index].address.a.val[3],
+			 devices[index].address.a.val[2], devices[index].address.a.val[1],
+			 devices[index].address.a.val[0]
+#endif
+#if defined(CONFIG_APP_OUTPUT_DEVICE_NAME)
+			 , devices[index].name
+#endif
+			 );
+		snprintf(row.fields, sizeof(row.fields), ""
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+			 "%.2f,"
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+			 "%.2f,"
+#endif
+#ifdef CONFIG_APP_ESS_PRESSURE
+			 "%.0f,"
+#endif
+#ifdef CONFIG_APP_ESS_DEW_POINT
+			 "%d,"
 #endif
 #ifdef CONFIG_APP_BATTERY_LEVEL
-		case FIND_BATTERY_LEVEL_CCC:
+			 "%d,"
 #endif
-		{
-			memcpy(&uuid, BT_UUID_GATT_CCC, sizeof(uuid));
-			action = 2;
-			break;
-		}
+			 "\n"
 #ifdef CONFIG_APP_ESS_TEMPERATURE
-		case SUBSCRIBE_TEMPERATURE:
-		{
-			param = &devices[current_index].handles.temperature;
-			action = 3;
-			break;
-		}
+			 , readings->temperature
 #endif
 #ifdef CONFIG_APP_ESS_HUMIDITY
-		case SUBSCRIBE_HUMDIITY:
-		{
-			param = &devices[current_index].handles.humidity;
-			action = 3;
-			break;
-		}
+			 , readings->humidity
 #endif
 #ifdef CONFIG_APP_ESS_PRESSURE
-		case SUBSCRIBE_PRESSURE:
-		{
-			param = &devices[current_index].handles.pressure;
-			action = 3;
-			break;
-		}
+			 , readings->pressure
 #endif
 #ifdef CONFIG_APP_ESS_DEW_POINT
-		case SUBSCRIBE_DEW_POINT:
-		{
-			param = &devices[current_index].handles.dew_point;
-			action = 3;
-			break;
-		}
+			 , readings->dew_point
 #endif
 #ifdef CONFIG_APP_BATTERY_LEVEL
-//todo
-		case SUBSCRIBE_BATTERY_LEVEL:
-		{
-			param = &devices[current_index].handles.battery_level;
-			action = 3;
-			break;
-		}
+			 , readings->battery_level
 #endif
-		default:
-		{
-			LOG_ERR("Invalid state execution attempted: %d, maximum is %d (AWAITING_READINGS)", devices[current_index].handles.status, AWAITING_READINGS);
-			return;
-		}
+			 );
+#endif
+	}
 
-	};
+	key = k_spin_lock(&output_rows_lock);
+	memcpy(&output_rows[index], &row, sizeof(struct output_row));
+	k_spin_unlock(&output_rows_lock, key);
+}
 
-LOG_ERR("action is %d, state is %d", action, devices[current_index].handles.status);
+/* Copies the row of a device, returns true if it has a complete set of readings and, if max_age
+ * is not 0, they were received within max_age milliseconds
+ */
+static bool output_row_get(uint8_t index, int64_t max_age, struct output_row *row)
+{
+	k_spinlock_key_t key = k_spin_lock(&output_rows_lock);
 
-	if (action == 0) {
-		/* Find characteristic of service */
-		if (service == 0) {
-			discover_params.start_handle = devices[current_index].handles.service + 1;
-		} else {
-			discover_params.start_handle = devices[current_index].handles.battery_service + 1;
-		}
-		discover_params.type = BT_GATT_DISCOVER_CHARACTERISTIC;
-	} else if (action == 1) {
-		/* Find service */
-		discover_params.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
-		discover_params.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
-		discover_params.type = BT_GATT_DISCOVER_PRIMARY;
-	} else if (action == 2) {
-		/* Find descriptor of discovered characteristic */
-		discover_params.start_handle = attr->handle + 2;
-		discover_params.type = BT_GATT_DISCOVER_DESCRIPTOR;
-	} else if (action == 3) {
-		/* Subscribe for notifications */
-		param->subscribe = subscribe_func;
-		param->notify = notify_func;
-		param->value = BT_GATT_CCC_NOTIFY;
+	memcpy(row, &output_rows[index], sizeof(struct output_row));
+	k_spin_unlock(&output_rows_lock, key);
+
+	if (row->oldest == 0) {
+		return false;
+	}
+
+	return (max_age == 0 || (k_uptime_get() - row->oldest) <= max_age);
+}
+
+/* Joins a row and its timestamp into a line of at most OUTPUT_LINE_SIZE, returns its length */
+static size_t output_row_line(const struct output_row *row, char *line, size_t size)
+{
+	int length;
+
+	length = snprintf(line, size, "%s"
+#if defined(CONFIG_APP_OUTPUT_TIMESTAMP)
+			  "%lld,"
+#endif
+			  "%s", row->head
+#if defined(CONFIG_APP_OUTPUT_TIMESTAMP)
+			  , output_time(row->oldest)
+#endif
+			  , row->fields);
+
+	return (length > 0 ? MIN((size_t)length, (size - 1)) : 0);
+}
+
+/* Drops every row, rows include the device number which changes when the roster does */
+static void output_rows_clear(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&output_rows_lock);
+
+	memset(output_rows, 0, sizeof(output_rows));
+	k_spin_unlock(&output_rows_lock, key);
+}
+
+#ifdef CONFIG_APP_TELEMETRY
+static const struct device *const telemetry_uart = DEVICE_DT_GET(DT_NODELABEL(telemetry_uart));
+RING_BUF_DECLARE(telemetry_ring, CONFIG_APP_TELEMETRY_BUFFER_SIZE);
+static struct k_spinlock telemetry_lock;
+static uint32_t telemetry_dropped = 0;
+
+/* Uptime readings were last output on the telemetry channel, used to only output each set once */
+static int64_t telemetry_readings_output[DEVICE_SLOTS];
+
+static void telemetry_isr(const struct device *dev, void *user_data)
+{
+	while (uart_irq_update(dev) && uart_irq_is_pending(dev)) {
+		if (uart_irq_rx_ready(dev)) {
+			uint8_t discard[16];
+
+			/* Nothing is received on this channel */
+			(void)uart_fifo_read(dev, discard, sizeof(discard));
+		}
+
+		if (uart_irq_tx_ready(dev)) {
+			k_spinlock_key_t key = k_spin_lock(&telemetry_lock);
+			uint8_t *data;
+			uint32_t size;
+			int sent;
+
+			size = ring_buf_get_claim(&telemetry_ring, &data, CONFIG_APP_TELEMETRY_BUFFER_SIZE);
+
+			if (size == 0) {
+				uart_irq_tx_disable(dev);
+				k_spin_unlock(&telemetry_lock, key);
+				break;
+			}
+
+			sent = uart_fifo_fill(dev, data, size);
+			(void)ring_buf_get_finish(&telemetry_ring, (sent > 0 ? sent : 0));
+			k_spin_unlock(&telemetry_lock, key);
+		}
+	}
+}
+
+/* Queues a record for output without blocking, if there is no space for the whole record then
+ * it is dropped
+ */
+static void telemetry_send(const uint8_t *data, uint32_t length)
+{
+	k_spinlock_key_t key = k_spin_lock(&telemetry_lock);
+
+	if (ring_buf_space_get(&telemetry_ring) < length) {
+		++telemetry_dropped;
+	} else {
+		(void)ring_buf_put(&telemetry_ring, data, length);
+	}
+
+	k_spin_unlock(&telemetry_lock, key);
+	uart_irq_tx_enable(telemetry_uart);
+}
+
+/* Outputs the readings of a device if every reading has been updated since they were last
+ * output, must only be called from the pipeline thread
+ */
+static void telemetry_readings(uint8_t index, const struct device_readings *readings)
+{
+	char buffer[96];
+	int length;
+
+	if (!readings_new_set(readings, &telemetry_readings_output[index])) {
+		return;
+	}
+
+	length = snprintf(buffer, sizeof(buffer), "%d,%lld,"
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+			  "%.2f,"
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+			  "%.2f,"
+#endif
+#ifdef CONFIG_APP_ESS_PRESSURE
+			  "%.0f,"
+#endif
+#ifdef CONFIG_APP_ESS_DEW_POINT
+			  "%d,"
+#endif
+#ifdef CONFIG_APP_BATTERY_LEVEL
+			  "%d,"
+#endif
+			  "\n", (device_id_value_offset + index),
+			  output_time(readings_oldest(readings))
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+			  , readings->temperature
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+			  , readings->humidity
+#endif
+#ifdef CONFIG_APP_ESS_PRESSURE
+			  , readings->pressure
+#endif
+#ifdef CONFIG_APP_ESS_DEW_POINT
+			  , readings->dew_point
+#endif
+#ifdef CONFIG_APP_BATTERY_LEVEL
+			  , readings->battery_level
+#endif
+			  );
+
+	if (length > 0 && length < sizeof(buffer)) {
+		telemetry_send(buffer, length);
+	}
+}
+#endif
+
+#ifdef CONFIG_APP_HISTORY
+#define HISTORY_MAGIC 0x48535431
+#define HISTORY_VERSION 2
+#define HISTORY_SECTORS_MAX 64
+#define HISTORY_PARTITION FIXED_PARTITION_ID(history_partition)
+
+BUILD_ASSERT(FIXED_PARTITION_EXISTS(history_partition),
+	     "History needs a history_partition, apply overlay-history.overlay");
+
+/* Sample in the history log, the time is in seconds since the epoch if the host had synced the
+ * time when it was recorded, otherwise in seconds since boot. Devices are kept by address as
+ * device numbers change when the roster does, the local sensor has an all zero address
+ */
+struct history_sample {
+	uint32_t time;
+	bt_addr_le_t address;
+	struct packed_readings readings;
+} __packed;
+
+/* Each log entry is a header followed by a batch of consecutive samples */
+struct history_header {
+	uint32_t sequence; /* Sequence number of the first sample */
+	uint8_t count;
+} __packed;
+
+struct history_batch {
+	struct history_header header;
+	struct history_sample samples[CONFIG_APP_HISTORY_BATCH];
+} __packed;
+
+static struct fcb history_fcb;
+static struct flash_sector history_sectors[HISTORY_SECTORS_MAX];
+static bool history_ready = false;
+static struct history_batch history_pending; /* Protected by history_lock */
+static struct history_batch history_writing; /* Only used by history_flush */
+static K_MUTEX_DEFINE(history_lock);
+static struct k_work_delayable history_flush_work;
+static uint32_t history_acknowledged = 0; /* Sequence number the host has read up to */
+static uint32_t history_dropped = 0;
+static int64_t history_readings_output[DEVICE_SLOTS];
+
+/* Queues a sample to be written to the log, called from the pipeline thread. Samples are only
+ * written once a batch is full or has been held for the flush interval, so that flash writes
+ * and erases are infrequent and happen on the system workqueue
+ */
+static void history_add(uint8_t index, const struct device_readings *readings)
+{
+	struct history_sample *sample;
+	bool full;
+
+	if (!history_ready) {
+		return;
+	}
+
+	k_mutex_lock(&history_lock, K_FOREVER);
+
+	if (history_pending.header.count == CONFIG_APP_HISTORY_BATCH) {
+		/* Previous batch has not been picked up yet */
+		++history_dropped;
+		k_mutex_unlock(&history_lock);
+		return;
+	}
+
+	sample = &history_pending.samples[history_pending.header.count];
+	sample->time = (uint32_t)(output_time(readings_oldest(readings)) / MSEC_PER_SEC);
+
+	if (index == DEVICE_SLOTS) {
+		/* Numbered after the roster, as everywhere else the local sensor is output */
+		memset(&sample->address, 0, sizeof(bt_addr_le_t));
+		readings_pack(device_count, readings, &sample->readings);
+	} else {
+		bt_addr_le_copy(&sample->address, &devices[index].address);
+		readings_pack(index, readings, &sample->readings);
+	}
+
+	++history_pending.header.count;
+	full = (history_pending.header.count == CONFIG_APP_HISTORY_BATCH);
+	k_mutex_unlock(&history_lock);
+
+	if (full) {
+		(void)k_work_reschedule(&history_flush_work, K_NO_WAIT);
+	} else {
+		(void)k_work_schedule(&history_flush_work,
+				      K_SECONDS(CONFIG_APP_HISTORY_FLUSH_INTERVAL));
+	}
+}
+
+/* Writes the pending batch as one log entry, erasing the oldest sector if the log is full */
+static void history_flush(struct k_work *work)
+{
+	struct fcb_entry location;
+	size_t length;
+	int err;
+
+	k_mutex_lock(&history_lock, K_FOREVER);
+	memcpy(&history_writing, &history_pending, sizeof(struct history_batch));
+	history_pending.header.sequence += history_pending.header.count;
+	history_pending.header.count = 0;
+	k_mutex_unlock(&history_lock);
+
+	if (history_writing.header.count == 0) {
+		return;
+	}
+
+	length = sizeof(struct history_header) +
+		 (history_writing.header.count * sizeof(struct history_sample));
+	err = fcb_append(&history_fcb, length, &location);
+
+	if (err == -ENOSPC) {
+		err = fcb_rotate(&history_fcb);
+
+		if (!err) {
+			err = fcb_append(&history_fcb, length, &location);
+		}
+	}
+
+	if (!err) {
+		err = flash_area_write(history_fcb.fap, FCB_ENTRY_FA_DATA_OFF(location),
+				       &history_writing, length);
+	}
+
+	if (!err) {
+		err = fcb_append_finish(&history_fcb, &location);
+	}
+
+	if (err) {
+		LOG_ERR("History write failed: %d", err);
+		history_dropped += history_writing.header.count;
+	}
+}
+
+/* Reads the header of a log entry, returns 0 on success */
+/* Reads the header of an entry, entries whose sample count does not match their length are
+ * rejected so that the samples can be indexed by the count
+ */
+static int history_header_read(const struct fcb_entry_ctx *entry, struct history_header *header)
+{
+	int err;
+
+	if (entry->loc.fe_data_len < sizeof(struct history_header) ||
+	    entry->loc.fe_data_len > sizeof(struct history_batch)) {
+		return -EINVAL;
+	}
+
+	err = flash_area_read(entry->fap, FCB_ENTRY_FA_DATA_OFF(entry->loc), header,
+			      sizeof(struct history_header));
+
+	if (err) {
+		return err;
+	}
+
+	if (header->count > CONFIG_APP_HISTORY_BATCH ||
+	    entry->loc.fe_data_len != (sizeof(struct history_header) +
+				       (header->count * sizeof(struct history_sample)))) {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int history_resume_walk(struct fcb_entry_ctx *entry, void *arg)
+{
+	struct history_header header;
+
+	if (history_header_read(entry, &header) == 0) {
+		history_pending.header.sequence = header.sequence + header.count;
+	}
+
+	return 0;
+}
+
+/* Mounts the log, erasing it if it is not valid, and continues numbering from the newest entry */
+static int history_init(void)
+{
+	const struct flash_area *area;
+	uint32_t sectors = HISTORY_SECTORS_MAX;
+	int err;
+
+	err = flash_area_get_sectors(HISTORY_PARTITION, &sectors, history_sectors);
+
+	if (err) {
+		return err;
+	}
+
+	history_fcb.f_magic = HISTORY_MAGIC;
+	history_fcb.f_version = HISTORY_VERSION;
+	history_fcb.f_sector_cnt = (uint8_t)sectors;
+	history_fcb.f_scratch_cnt = 0;
+	history_fcb.f_sectors = history_sectors;
+	err = fcb_init(HISTORY_PARTITION, &history_fcb);
+
+	if (err) {
+		LOG_ERR("History log not valid (err %d), erasing", err);
+		err = flash_area_open(HISTORY_PARTITION, &area);
+
+		if (err) {
+			return err;
+		}
+
+		err = flash_area_erase(area, 0, area->fa_size);
+		flash_area_close(area);
+
+		if (err) {
+			return err;
+		}
+
+		err = fcb_init(HISTORY_PARTITION, &history_fcb);
+
+		if (err) {
+			return err;
+		}
+	}
+
+	(void)fcb_walk(&history_fcb, NULL, history_resume_walk, NULL);
+	k_work_init_delayable(&history_flush_work, history_flush);
+	history_ready = true;
+
+	return 0;
+}
+
+/* Sets the position the host has read up to, which is kept in settings so that reads without
+ * a start continue from it after a reboot
+ */
+static void history_acknowledge(uint32_t sequence)
+{
+#ifdef CONFIG_APP_ROSTER_SETTINGS
+	int err;
+#endif
+
+	history_acknowledged = sequence;
+
+#ifdef CONFIG_APP_ROSTER_SETTINGS
+	err = settings_save_one("app/history", &history_acknowledged,
+				sizeof(history_acknowledged));
+
+	if (err) {
+		LOG_ERR("History position save failed: %d", err);
+	}
+#endif
+}
+#endif
+
+#if defined(CONFIG_APP_AGGREGATES) || defined(CONFIG_APP_ALARMS)
+/* Gets a reading by bit index as a double */
+static double reading_value(const struct device_readings *readings, uint8_t field)
+{
+	if (0) {
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+	} else if (BIT(field) == RECEIVED_TEMPERATURE) {
+		return readings->temperature;
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+	} else if (BIT(field) == RECEIVED_HUMIDITY) {
+		return readings->humidity;
+#endif
+#ifdef CONFIG_APP_ESS_PRESSURE
+	} else if (BIT(field) == RECEIVED_PRESSURE) {
+		return readings->pressure;
+#endif
+#ifdef CONFIG_APP_ESS_DEW_POINT
+	} else if (BIT(field) == RECEIVED_DEW_POINT) {
+		return readings->dew_point;
+#endif
+#ifdef CONFIG_APP_BATTERY_LEVEL
+	} else if (BIT(field) == RECEIVED_BATTERY_LEVEL) {
+		return readings->battery_level;
+#endif
+	}
+
+	return 0.0;
+}
+#endif
+
+#ifdef CONFIG_APP_ALARMS
+#define ALARM_RULES CONFIG_APP_ALARM_RULES
+#define ALARM_FAN_NONE -1
+
+enum alarm_direction {
+	ALARM_ABOVE = 0,
+	ALARM_BELOW,
+};
+
+/* Devices are kept by address as device numbers change when the roster does */
+struct alarm_rule {
+	bool used;
+	bool local;
+	bt_addr_le_t address;
+	uint8_t field; /* Reading bit index */
+	uint8_t direction;
+	int8_t fan_speed; /* Forced whilst the rule is triggered, ALARM_FAN_NONE to leave the fan */
+	float threshold;
+	float hysteresis;
+};
+
+static struct alarm_rule alarm_rules[ALARM_RULES];
+static bool alarm_triggered[ALARM_RULES];
+static uint16_t alarm_counts[ALARM_RULES];
+static bool alarm_fan_forced = false;
+static struct fan_request alarm_fan_saved; /* Latest fan request from the shell while forced */
+static K_MUTEX_DEFINE(alarm_lock);
+
+#ifdef CONFIG_APP_ROSTER_SETTINGS
+static void alarm_save(void)
+{
+	int err = settings_save_one("app/alarms", alarm_rules, sizeof(alarm_rules));
+
+	if (err) {
+		LOG_ERR("Alarm save failed: %d", err);
+	}
+}
+#else
+#define alarm_save()
+#endif
+
+static bool alarm_matches(const struct alarm_rule *rule, uint8_t index)
+{
+	if (index == DEVICE_SLOTS) {
+		return rule->local;
+	}
+
+	return (!rule->local && bt_addr_le_cmp(&rule->address, &devices[index].address) == 0);
+}
+
+/* Outputs an alarm record straight away, on the telemetry channel if it is enabled. Records
+ * start with ! to tell them apart from readings
+ */
+static void alarm_output(uint8_t rule, uint8_t index, double value, bool triggered)
+{
+	char buffer[80];
+	char device[8];
+	int length;
+
+	if (index == DEVICE_SLOTS) {
+		strcpy(device, "local");
+	} else {
+		snprintf(device, sizeof(device), "%d", (device_id_value_offset + index));
+	}
+
+	length = snprintf(buffer, sizeof(buffer), "!alarm,%d,%s,%s,%s,%lld,%.2f\n", (rule + 1),
+			  device, field_names[alarm_rules[rule].field], (triggered ? "set" : "clear"),
+			  output_time(k_uptime_get()), value);
+
+	LOG_ERR("Alarm %d %s: device %s %s %.2f", (rule + 1), (triggered ? "set" : "clear"), device,
+		field_names[alarm_rules[rule].field], value);
+
+#ifdef CONFIG_APP_TELEMETRY
+	telemetry_send(buffer, MIN(length, (int)(sizeof(buffer) - 1)));
+#endif
+}
+
+/* Forces the fan to the highest speed of the triggered rules, or puts back the latest request from
+ * the shell once none are triggered. Must be called with alarm_lock held
+ */
+static void alarm_fan_update(void)
+{
+	struct fan_request request;
+	int8_t speed = ALARM_FAN_NONE;
+	uint8_t i = 0;
+
+	while (i < ALARM_RULES) {
+		if (alarm_rules[i].used && alarm_triggered[i] && alarm_rules[i].fan_speed > speed) {
+			speed = alarm_rules[i].fan_speed;
+		}
+
+		++i;
+	}
+
+	if (speed == ALARM_FAN_NONE) {
+		if (alarm_fan_forced) {
+			alarm_fan_forced = false;
+			(void)zbus_chan_pub(&fan_chan, &alarm_fan_saved, K_MSEC(100));
+		}
+
+		return;
+	}
+
+	if (!alarm_fan_forced) {
+		(void)zbus_chan_read(&fan_chan, &alarm_fan_saved, K_MSEC(100));
+		alarm_fan_forced = true;
+	}
+
+	memcpy(&request, &alarm_fan_saved, sizeof(request));
+	request.speed = (uint8_t)speed;
+	request.half = false;
+	request.slew_rate = 0;
+
+	if (zbus_chan_pub(&fan_chan, &request, K_MSEC(100)) != 0) {
+		LOG_ERR("Alarm fan request failed");
+	}
+}
+
+/* Checks the rules of a device against its changed readings, must only be called from the
+ * pipeline thread
+ */
+static void alarm_check(uint8_t index, enum readings_received_t changed,
+			const struct device_readings *readings)
+{
+	uint8_t i = 0;
+	bool fan_changed = false;
+
+	k_mutex_lock(&alarm_lock, K_FOREVER);
+
+	while (i < ALARM_RULES) {
+		const struct alarm_rule *rule = &alarm_rules[i];
+
+		if (rule->used && (changed & BIT(rule->field)) && alarm_matches(rule, index)) {
+			double value = reading_value(readings, rule->field);
+			bool triggered;
+
+			/* Once triggered, the reading must pass back over the hysteresis to clear */
+			if (rule->direction == ALARM_ABOVE) {
+				triggered = (alarm_triggered[i] ?
+					     (value > (rule->threshold - rule->hysteresis)) :
+					     (value > rule->threshold));
+			} else {
+				triggered = (alarm_triggered[i] ?
+					     (value < (rule->threshold + rule->hysteresis)) :
+					     (value < rule->threshold));
+			}
+
+			if (triggered != alarm_triggered[i]) {
+				alarm_triggered[i] = triggered;
+
+				if (triggered) {
+					++alarm_counts[i];
+				}
+
+				alarm_output(i, index, value, triggered);
+
+				if (rule->fan_speed != ALARM_FAN_NONE) {
+					fan_changed = true;
+				}
+			}
+		}
+
+		++i;
+	}
+
+	if (fan_changed) {
+		alarm_fan_update();
+	}
+
+	k_mutex_unlock(&alarm_lock);
+}
+#endif
+
+/* Passes published readings to each consumer */
+static void pipeline_consume(const struct readings_message *message)
+{
+	uint8_t index = message->index;
+#ifdef CONFIG_APP_AGGREGATES
+	uint8_t field = 0;
+
+	while (field < READING_FIELDS) {
+		if (message->changed & BIT(field)) {
+			aggregate_add(index, BIT(field), reading_value(&message->readings, field));
+		}
+
+		++field;
+	}
+#endif
+
+#ifdef CONFIG_APP_ALARMS
+	alarm_check(index, message->changed, &message->readings);
+#endif
+
+	if (index == DEVICE_SLOTS) {
+		/* Local sensor readings are always output as they are all sampled together */
+#ifdef CONFIG_APP_GATT_SERVER
+		server_readings_updated(DEVICE_SLOTS);
+#endif
+
+#ifdef CONFIG_APP_BROADCAST
+		k_work_submit(&broadcast_work);
+#endif
+
+#ifdef CONFIG_APP_HISTORY
+		history_add(index, &message->readings);
+#endif
+		return;
+	}
+
+	output_row_update(index, &message->readings);
+
+#ifdef CONFIG_APP_TELEMETRY
+	telemetry_readings(index, &message->readings);
+#endif
+
+#ifdef CONFIG_APP_GATT_SERVER
+	if (readings_new_set(&message->readings, &server_readings_output[index])) {
+		server_readings_updated(index);
+	}
+#endif
+
+#ifdef CONFIG_APP_BROADCAST
+	if (readings_new_set(&message->readings, &broadcast_readings_output[index])) {
+		k_work_submit(&broadcast_work);
+	}
+#endif
+
+#ifdef CONFIG_APP_HISTORY
+	if (readings_new_set(&message->readings, &history_readings_output[index])) {
+		history_add(index, &message->readings);
+	}
+#endif
+}
+
+static void pipeline_function(void *, void *, void *)
+{
+	const struct zbus_channel *channel;
+	struct readings_message message;
+
+	while (1) {
+		if (zbus_sub_wait_msg(&pipeline_subscriber, &channel, &message, K_FOREVER) == 0 &&
+		    channel == &readings_chan) {
+			pipeline_consume(&message);
+		}
+	}
+}
+
+#ifdef CONFIG_APP_STATE_TRACE
+/* Named trace point of the connection state machine, scripts/state_timeline.py turns these into
+ * a timeline per device
+ */
+#define state_trace(event, index, value) sys_trace_named_event(event, (uint32_t)(index), \
+							       (uint32_t)(value))
+#else
+#define state_trace(event, index, value)
+#endif
+
+#ifdef CONFIG_APP_ADAPTIVE_PHY
+/* Failed connection attempts and setups count towards moving a device to LE Coded */
+#define phy_link_failed(index) devices[index].failure_streak = \
+	MIN((devices[index].failure_streak + 1), UINT8_MAX)
+#define phy_link_succeeded(index) devices[index].failure_streak = 0
+#else
+#define phy_link_failed(index)
+#define phy_link_succeeded(index)
+#endif
+
+#ifdef CONFIG_APP_STATE_WATCHDOG
+/* (Re)starts the deadline for the current step of the device being set up */
+static void state_watchdog_arm(k_timeout_t timeout)
+{
+	(void)k_work_reschedule_for_queue(&bt_work_q, &state_watchdog, timeout);
+}
+
+static void state_watchdog_cancel(void)
+{
+	(void)k_work_cancel_delayable(&state_watchdog);
+}
+
+#ifdef CONFIG_APP_POLLING
+/* Deadline for the whole poll of a device, from connecting until disconnecting, which is
+ * handled in the same way as a step timing out
+ */
+static void poll_deadline_arm(void)
+{
+	(void)k_work_reschedule_for_queue(&bt_work_q, &poll_deadline, K_MSEC(CONFIG_APP_POLL_DEADLINE));
+}
+
+static void poll_deadline_cancel(void)
+{
+	(void)k_work_cancel_delayable(&poll_deadline);
+}
+#else
+#define poll_deadline_arm()
+#define poll_deadline_cancel()
+#endif
+
+static void state_watchdog_expired(struct k_work *work)
+{
+	int err;
+
+	if (!busy || devices[current_index].state == STATE_IDLE ||
+	    devices[current_index].state == STATE_ACTIVE) {
+		return;
+	}
+
+	LOG_ERR("Device %d timed out in state %d/%d", current_index, devices[current_index].state,
+		devices[current_index].handles.status);
+	state_trace("timeout", current_index, devices[current_index].handles.status);
+	++devices[current_index].stats.timeouts;
+	phy_link_failed(current_index);
+
+	/* Tearing down the link (or cancelling the connection attempt) reschedules the device
+	 * from the connected/disconnected callbacks
+	 */
+	err = -ENOTCONN;
+
+	if (devices[current_index].connection != NULL) {
+		err = bt_conn_disconnect(devices[current_index].connection,
+					 BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	}
+
+	if (err) {
+		LOG_ERR("Watchdog disconnect failed: %d", err);
+
+		/* Forcibly move on to the next device, the connection reference is released when
+		 * the disconnected callback arrives
+		 */
+		state_watchdog_cancel();
+		poll_deadline_cancel();
+		devices[current_index].state = STATE_IDLE;
+		devices[current_index].connection = NULL;
+		busy = false;
+
+		++current_index;
+
+		if (current_index >= device_count) {
+			current_index = 0;
+		}
+
+		k_sem_give(&next_action_sem);
+	}
+}
+#else
+#define state_watchdog_arm(timeout)
+#define state_watchdog_cancel()
+#endif
+
+#ifdef CONFIG_APP_TX_POWER
+#define RSSI_UNKNOWN BT_HCI_LE_RSSI_NOT_AVAILABLE
+
+/* Reads the RSSI of a connection, returns 0 on success */
+static int connection_rssi_read(uint16_t handle, int8_t *rssi)
+{
+	struct net_buf *buf;
+	struct net_buf *rsp = NULL;
+	struct bt_hci_cp_read_rssi *cp;
+	struct bt_hci_rp_read_rssi *rp;
+	int err;
+
+	buf = bt_hci_cmd_create(BT_HCI_OP_READ_RSSI, sizeof(*cp));
+
+	if (buf == NULL) {
+		return -ENOBUFS;
+	}
+
+	cp = net_buf_add(buf, sizeof(*cp));
+	cp->handle = sys_cpu_to_le16(handle);
+	err = bt_hci_cmd_send_sync(BT_HCI_OP_READ_RSSI, buf, &rsp);
+
+	if (err) {
+		return err;
+	}
+
+	rp = (struct bt_hci_rp_read_rssi *)rsp->data;
+	*rssi = rp->rssi;
+	net_buf_unref(rsp);
+
+	return 0;
+}
+
+/* Sets the TX power of a connection using the vendor specific command, the controller picks the
+ * nearest supported level which is returned in selected. Returns 0 on success
+ */
+static int connection_tx_power_set(uint16_t handle, int8_t level, int8_t *selected)
+{
+	struct net_buf *buf;
+	struct net_buf *rsp = NULL;
+	struct bt_hci_cp_vs_write_tx_power_level *cp;
+	struct bt_hci_rp_vs_write_tx_power_level *rp;
+	int err;
+
+	buf = bt_hci_cmd_create(BT_HCI_OP_VS_WRITE_TX_POWER_LEVEL, sizeof(*cp));
+
+	if (buf == NULL) {
+		return -ENOBUFS;
+	}
+
+	cp = net_buf_add(buf, sizeof(*cp));
+	cp->handle = sys_cpu_to_le16(handle);
+	cp->handle_type = BT_HCI_VS_LL_HANDLE_TYPE_CONN;
+	cp->tx_power_level = level;
+	err = bt_hci_cmd_send_sync(BT_HCI_OP_VS_WRITE_TX_POWER_LEVEL, buf, &rsp);
+
+	if (err) {
+		return err;
+	}
+
+	rp = (struct bt_hci_rp_vs_write_tx_power_level *)rsp->data;
+	*selected = rp->selected_tx_power;
+	net_buf_unref(rsp);
+
+	return 0;
+}
+
+#ifdef CONFIG_APP_ADAPTIVE_PHY
+#define PHY_HYSTERESIS 5
+
+static const char * const phy_policy_names[PHY_POLICY_COUNT] = {
+	"auto",
+	"1m",
+	"2m",
+	"coded",
+};
+
+/* Picks the PHY for a device. The automatic policy moves to LE Coded once the link is weak or
+ * keeps failing and to 2M whilst it is strong, which shortens discovery and reads, with some
+ * hysteresis so that a link near a threshold does not keep switching. Without an RSSI the
+ * current PHY is kept
+ */
+static uint8_t phy_choose(uint8_t index, int8_t rssi)
+{
+	uint8_t current = devices[index].phy;
+
+	switch (devices[index].phy_policy) {
+		case PHY_POLICY_1M:
+		{
+			return BT_GAP_LE_PHY_1M;
+		}
+		case PHY_POLICY_2M:
+		{
+			return BT_GAP_LE_PHY_2M;
+		}
+		case PHY_POLICY_CODED:
+		{
+			return BT_GAP_LE_PHY_CODED;
+		}
+		default:
+		{
+			break;
+		}
+	};
+
+	if (devices[index].failure_streak >= CONFIG_APP_PHY_CODED_FAILURES) {
+		return BT_GAP_LE_PHY_CODED;
+	}
+
+	if (rssi == RSSI_UNKNOWN) {
+		return (current == 0 ? BT_GAP_LE_PHY_1M : current);
+	}
+
+	if (rssi < CONFIG_APP_PHY_CODED_RSSI ||
+	    (current == BT_GAP_LE_PHY_CODED && rssi < (CONFIG_APP_PHY_CODED_RSSI + PHY_HYSTERESIS))) {
+		return BT_GAP_LE_PHY_CODED;
+	}
+
+	if (rssi >= CONFIG_APP_PHY_2M_RSSI ||
+	    (current == BT_GAP_LE_PHY_2M && rssi >= (CONFIG_APP_PHY_2M_RSSI - PHY_HYSTERESIS))) {
+		return BT_GAP_LE_PHY_2M;
+	}
+
+	return BT_GAP_LE_PHY_1M;
+}
+
+/* Requests a PHY update of a connection if the chosen PHY differs from the current one, the
+ * result arrives in le_phy_updated()
+ */
+static void phy_adapt(uint8_t index, struct bt_conn *conn, int8_t rssi)
+{
+	struct bt_conn_le_phy_param param;
+	uint8_t phy = phy_choose(index, rssi);
+	int err;
+
+	if (phy == devices[index].phy) {
+		return;
+	}
+
+	/* PHY values are already the preference bits */
+	param.options = (phy == BT_GAP_LE_PHY_CODED ? BT_CONN_LE_PHY_OPT_CODED_S8 :
+			 BT_CONN_LE_PHY_OPT_NONE);
+	param.pref_tx_phy = phy;
+	param.pref_rx_phy = phy;
+	err = bt_conn_le_phy_update(conn, &param);
+
+	if (err) {
+		LOG_ERR("PHY update failed (err %d)", err);
+	} else {
+		state_trace("phy_request", index, phy);
+	}
+}
+
+static void le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+{
+	uint8_t i = 0;
+
+	while (i < device_count) {
+		if (devices[i].connection == conn) {
+			devices[i].phy = param->tx_phy;
+			state_trace("phy", i, param->tx_phy);
+			break;
+		}
+
+		++i;
+	}
+}
+#endif
+
+/* Samples the RSSI of each connected device and steps its TX power towards the target RSSI
+ * window, runs periodically whilst any device is connected. The link is assumed to be
+ * symmetrical, so a strong received signal means the device also hears us well
+ */
+static void tx_power_update(struct k_work *work)
+{
+	struct bt_conn *conn;
+	uint16_t handle;
+	int8_t rssi;
+	int8_t level;
+	int8_t selected;
+	bool active = false;
+	uint8_t i = 0;
+
+	while (i < device_count) {
+		conn = devices[i].connection;
+
+		if (conn != NULL && devices[i].state >= STATE_CONNECTED) {
+			/* Keep sampling even if a read fails, the connection is still up */
+			active = true;
+		}
+
+		if (conn != NULL && devices[i].state >= STATE_CONNECTED &&
+		    bt_hci_get_conn_handle(conn, &handle) == 0 &&
+		    connection_rssi_read(handle, &rssi) == 0 && rssi != RSSI_UNKNOWN) {
+			devices[i].rssi = rssi;
+			devices[i].stats.rssi_total += rssi;
+			++devices[i].stats.rssi_samples;
+
+			if (rssi < devices[i].stats.rssi_min) {
+				devices[i].stats.rssi_min = rssi;
+			}
+
+			level = devices[i].tx_power;
+
+			if (rssi > CONFIG_APP_TX_POWER_RSSI_HIGH) {
+				level -= CONFIG_APP_TX_POWER_STEP;
+			} else if (rssi < CONFIG_APP_TX_POWER_RSSI_LOW) {
+				level += CONFIG_APP_TX_POWER_STEP;
+			}
+
+			level = CLAMP(level, CONFIG_APP_TX_POWER_MIN, CONFIG_APP_TX_POWER_MAX);
+
+			if (level != devices[i].tx_power &&
+			    connection_tx_power_set(handle, level, &selected) == 0) {
+				devices[i].tx_power = selected;
+				state_trace("tx_power", i, selected);
+			}
+
+#ifdef CONFIG_APP_ADAPTIVE_PHY
+			phy_adapt(i, conn, rssi);
+#endif
+		}
+
+		++i;
+	}
+
+	if (active) {
+		(void)k_work_reschedule_for_queue(&bt_work_q, &tx_power_work,
+						  K_SECONDS(CONFIG_APP_TX_POWER_INTERVAL));
+	}
+}
+
+/* Starts sampling a new connection, which the controller sets up at its default TX power */
+static void tx_power_connected(uint8_t index)
+{
+	devices[index].rssi = RSSI_UNKNOWN;
+	devices[index].tx_power = CONFIG_APP_TX_POWER_MAX;
+
+	if (devices[index].stats.rssi_samples == 0) {
+		devices[index].stats.rssi_min = INT8_MAX;
+	}
+
+#ifdef CONFIG_APP_ADAPTIVE_PHY
+	/* The first sample picks the PHY, so it is taken straight away */
+	(void)k_work_reschedule_for_queue(&bt_work_q, &tx_power_work, K_NO_WAIT);
+#else
+	(void)k_work_schedule_for_queue(&bt_work_q, &tx_power_work,
+					K_SECONDS(CONFIG_APP_TX_POWER_INTERVAL));
+#endif
+}
+#endif
+
+#ifdef CONFIG_APP_CONN_PLANNER
+#define PLAN_EXPONENT_MAX 3
+#define PLAN_CYCLES BIT(PLAN_EXPONENT_MAX) /* Base intervals in the longest planned interval */
+#define PLAN_SLOTS ((CONFIG_APP_CONN_PLANNER_BASE_INTERVAL * 1250) / \
+		    CONFIG_APP_CONN_PLANNER_EVENT_LENGTH)
+#define PLAN_LINK_SLOTS (PLAN_SLOTS - CONFIG_APP_CONN_PLANNER_SCAN_SLOTS)
+#define PLAN_TIMEOUT_MIN 400
+#define PLAN_TIMEOUT_MAX 3200
+#define PLAN_SCAN_WINDOW_MIN 4
+
+BUILD_ASSERT(PLAN_SLOTS > CONFIG_APP_CONN_PLANNER_SCAN_SLOTS,
+	     "Base interval has no slots left for links");
+
+/* Connection events per longest planned interval of a link */
+static uint32_t plan_events(const struct link_plan *plan)
+{
+	return (PLAN_CYCLES >> plan->exponent);
+}
+
+/* Gets the connection events per longest planned interval of the links of devices other than
+ * index. The controller places the anchor points, so only the total is known, not where
+ * the events fall
+ */
+static uint32_t plan_load(uint8_t index)
+{
+	uint32_t load = 0;
+	uint8_t i = 0;
+
+	while (i < device_count) {
+		if (i != index && devices[i].state != STATE_IDLE && devices[i].plan.planned) {
+			load += plan_events(&devices[i].plan);
+		}
+
+		++i;
+	}
+
+	return load;
+}
+
+/* Finds the shortest interval of the harmonic set whose events still fit in the event lengths
+ * of the base interval not kept for scanning
+ */
+static bool plan_find(uint32_t load, struct link_plan *plan)
+{
+	plan->exponent = 0;
+
+	while (plan->exponent <= PLAN_EXPONENT_MAX) {
+		if ((load + plan_events(plan)) <= ((uint32_t)PLAN_LINK_SLOTS * PLAN_CYCLES)) {
+			return true;
+		}
+
+		++plan->exponent;
+	}
+
+	return false;
+}
+
+/* Scan window of the time links leave free on average in each base interval, 0.625 ms units.
+ * Where the window falls against the connection events is up to the controller
+ */
+static uint16_t plan_scan_window(uint32_t load)
+{
+	uint32_t free_events = (((uint32_t)PLAN_SLOTS * PLAN_CYCLES) - load) / PLAN_CYCLES;
+	uint32_t window = (free_events * CONFIG_APP_CONN_PLANNER_EVENT_LENGTH) / 625;
+
+	return MAX(window, PLAN_SCAN_WINDOW_MIN);
+}
+
+/* Supervision timeout for a span of intervals (1.25 ms units) of at least 6 missed events */
+static uint16_t plan_timeout(uint32_t span)
+{
+	return (uint16_t)CLAMP(((span * 6 * 125) / 1000), PLAN_TIMEOUT_MIN, PLAN_TIMEOUT_MAX);
+}
+
+/* Plans the link to a device. All intervals are multiples of the base interval, so once the
+ * controller has placed the anchor points apart, the events of planned links keep their
+ * spacing and never fall due together. If the links already use every event length of the
+ * base interval the default interval is used and false returned
+ */
+static bool plan_link(uint8_t index, struct bt_le_conn_param *conn_param,
+		      struct bt_conn_le_create_param *create_param)
+{
+	struct link_plan *plan = &devices[index].plan;
+	uint32_t load = plan_load(index);
+	uint16_t interval;
+
+	create_param->interval = (CONFIG_APP_CONN_PLANNER_BASE_INTERVAL * 2);
+	create_param->window = MIN(plan_scan_window(load), create_param->interval);
+	plan->interval = 0;
+	plan->planned = plan_find(load, plan);
+
+	if (!plan->planned) {
+		LOG_ERR("No room in connection plan for device %d", (index + device_id_value_offset));
+		conn_param->interval_min = BT_GAP_INIT_CONN_INT_MIN;
+		conn_param->interval_max = BT_GAP_INIT_CONN_INT_MAX;
+		conn_param->latency = 0;
+		conn_param->timeout = PLAN_TIMEOUT_MIN;
+
+		return false;
+	}
+
+	interval = (CONFIG_APP_CONN_PLANNER_BASE_INTERVAL << plan->exponent);
+	conn_param->interval_min = interval;
+	conn_param->interval_max = interval;
+	conn_param->latency = 0;
+	conn_param->timeout = plan_timeout(interval);
+
+	return true;
+}
+
+/* Peripherals asking for other parameters are given their planned interval, keeping their
+ * latency, so that the link keeps its spacing from the others
+ */
+static bool le_param_req(struct bt_conn *conn, struct bt_le_conn_param *param)
+{
+	uint8_t i = 0;
+	uint16_t interval;
+
+	while (i < device_count) {
+		if (devices[i].connection == conn) {
+			if (devices[i].plan.planned) {
+				interval = (CONFIG_APP_CONN_PLANNER_BASE_INTERVAL <<
+					    devices[i].plan.exponent);
+				param->interval_min = interval;
+				param->interval_max = interval;
+				param->timeout = MAX(param->timeout,
+						     plan_timeout((uint32_t)interval *
+								  (param->latency + 1)));
+			}
+
+			break;
+		}
+
+		++i;
+	}
+
+	return true;
+}
+
+static void le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency,
+			     uint16_t timeout)
+{
+	uint8_t i = 0;
+
+	while (i < device_count) {
+		if (devices[i].connection == conn) {
+			devices[i].plan.interval = interval;
+			state_trace("interval", i, interval);
+			break;
+		}
+
+		++i;
+	}
+}
+#endif
+
+#if defined(CONFIG_APP_TRACE) || defined(CONFIG_APP_HANDLE_CACHE)
+/* Gets the subscription of a reading by bit index, NULL if it is not subscribed to */
+static struct bt_gatt_subscribe_params *notification_params(uint8_t index, uint8_t field)
+{
+	if (0) {
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+	} else if (BIT(field) == RECEIVED_TEMPERATURE) {
+		return &devices[index].handles.temperature;
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+	} else if (BIT(field) == RECEIVED_HUMIDITY) {
+		return &devices[index].handles.humidity;
+#endif
+#ifdef CONFIG_APP_ESS_PRESSURE
+	} else if (BIT(field) == RECEIVED_PRESSURE) {
+		return &devices[index].handles.pressure;
+#endif
+#ifdef CONFIG_APP_ESS_DEW_POINT_SUBSCRIBE
+	} else if (BIT(field) == RECEIVED_DEW_POINT) {
+		return &devices[index].handles.dew_point;
+#endif
+#ifdef CONFIG_APP_BATTERY_LEVEL
+	} else if (BIT(field) == RECEIVED_BATTERY_LEVEL) {
+		return &devices[index].handles.battery_level;
+#endif
+	}
+
+	return NULL;
+}
+#endif
+
+#ifdef CONFIG_APP_TRACE
+#define TRACE_MAGIC 0x544e5345 /* "ESNT" */
+#define TRACE_VERSION 1
+#define TRACE_LATENCY_BUCKETS 16
+
+struct trace_header {
+	uint32_t magic;
+	uint8_t version;
+	uint8_t reserved;
+	uint16_t records;
+} __packed;
+
+/* Each record is followed by its payload */
+struct trace_record {
+	uint32_t time; /* Milliseconds since recording started */
+	uint16_t handle;
+	uint8_t device;
+	uint8_t field; /* Reading bit index */
+	uint8_t length;
+} __packed;
+
+static uint8_t trace_buffer[CONFIG_APP_TRACE_BUFFER_SIZE];
+static size_t trace_used = 0;
+static uint16_t trace_records = 0;
+static uint32_t trace_dropped = 0;
+static int64_t trace_start = 0;
+static bool trace_recording = false;
+static struct k_spinlock trace_lock;
+
+#ifdef CONFIG_APP_TRACE_REPLAY
+static const uint8_t replay_trace[] = {
+#include "notification_trace.inc"
+};
+#endif
+
+static void trace_add(uint8_t index, struct bt_gatt_subscribe_params *params, const void *data,
+		      uint16_t length)
+{
+	struct trace_record record;
+	k_spinlock_key_t key;
+	uint8_t field = 0;
+
+	if (!trace_recording) {
+		return;
+	}
+
+	while (field < READING_FIELDS && notification_params(index, field) != params) {
+		++field;
+	}
+
+	key = k_spin_lock(&trace_lock);
+
+	if (!trace_recording) {
+		k_spin_unlock(&trace_lock, key);
+		return;
+	}
+
+	if (length > UINT8_MAX || trace_records == UINT16_MAX ||
+	    (trace_used + sizeof(record) + length) > sizeof(trace_buffer)) {
+		++trace_dropped;
+		k_spin_unlock(&trace_lock, key);
+		return;
+	}
+
+	record.time = (uint32_t)(k_uptime_get() - trace_start);
+	record.handle = params->value_handle;
+	record.device = index;
+	record.field = field;
+	record.length = (uint8_t)length;
+
+	memcpy(&trace_buffer[trace_used], &record, sizeof(record));
+	memcpy(&trace_buffer[trace_used + sizeof(record)], data, length);
+	trace_used += sizeof(record) + length;
+	++trace_records;
+
+	k_spin_unlock(&trace_lock, key);
+}
+#endif
+
+/* Parses a notification from a device and publishes the readings */
+static void notification_process(uint8_t i, struct bt_gatt_subscribe_params *params,
+				 const void *data, uint16_t length)
+{
+	enum readings_received_t changed = RECEIVED_NONE;
+
+	if (0) {
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+	} else if (params == &devices[i].handles.temperature) {
+		uint16_t value;
+		double fp_value;
+
+		value = sys_get_le16(&((uint8_t *)data)[0]);
+		fp_value = ((double)value) / 100.0;
+
+		devices[i].readings.temperature = fp_value;
+		reading_received(&devices[i].readings, RECEIVED_TEMPERATURE);
+		changed = RECEIVED_TEMPERATURE;
+LOG_ERR("temp = %fc", fp_value);
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+	} else if (params == &devices[i].handles.humidity) {
+		uint16_t value;
+		double fp_value;
+
+		value = sys_get_le16(&((uint8_t *)data)[0]);
+		fp_value = ((double)value) / 100.0;
+
+		devices[i].readings.humidity = fp_value;
+		reading_received(&devices[i].readings, RECEIVED_HUMIDITY);
+		changed = RECEIVED_HUMIDITY;
+
+LOG_ERR("hum = %f%c", fp_value, '%');
+#endif
+#ifdef CONFIG_APP_ESS_PRESSURE
+	} else if (params == &devices[i].handles.pressure) {
+		uint32_t value;
+		double fp_value;
+
+		value = sys_get_le32(&((uint8_t *)data)[0]);
+		fp_value = (double)value;
+
+		devices[i].readings.pressure = fp_value;
+		reading_received(&devices[i].readings, RECEIVED_PRESSURE);
+		changed = RECEIVED_PRESSURE;
+
+LOG_ERR("press = %fPa", fp_value);
+#endif
+#ifdef CONFIG_APP_ESS_DEW_POINT_SUBSCRIBE
+	} else if (params == &devices[i].handles.dew_point) {
+		devices[i].readings.dew_point = ((int8_t *)data)[0];
+		reading_received(&devices[i].readings, RECEIVED_DEW_POINT);
+		changed = RECEIVED_DEW_POINT;
+
+LOG_ERR("dew = %dc", ((int8_t *)data)[0]);
+#endif
+#ifdef CONFIG_APP_BATTERY_LEVEL
+	} else if (params == &devices[i].handles.battery_level) {
+		devices[i].readings.battery_level = ((int8_t *)data)[0];
+		reading_received(&devices[i].readings, RECEIVED_BATTERY_LEVEL);
+		changed = RECEIVED_BATTERY_LEVEL;
+
+LOG_ERR("battery = %u%c", ((uint8_t *)data)[0], '%');
+#endif
+	} else {
+LOG_ERR("not valid");
+	}
+
+#ifdef CONFIG_APP_ESS_DEW_POINT_LOCAL
+	if ((params == &devices[i].handles.temperature || params == &devices[i].handles.humidity) &&
+	    dew_point_update(&devices[i].readings)) {
+		changed |= RECEIVED_DEW_POINT;
+	}
+#endif
+
+	if (devices[i].readings.received == RECEIVED_ALL && devices[i].stats.first_reading == 0) {
+		devices[i].stats.first_reading = k_uptime_get();
+		state_trace("first_reading", i, devices[i].stats.first_reading);
+	}
+
+	readings_publish(i);
+	pipeline_publish(i, changed, &devices[i].readings);
+}
+
+static uint8_t notify_func(struct bt_conn *conn, struct bt_gatt_subscribe_params *params,
+			   const void *data, uint16_t length)
+{
+	uint8_t i = 0;
+
+	if (!data) {
+		LOG_ERR("[UNSUBSCRIBED]");
+		params->value_handle = 0U;
+		return BT_GATT_ITER_STOP;
+	}
+
+	while (i < device_count) {
+		if (devices[i].connection == conn) {
+			break;
+		}
+		++i;
+	}
+
+	if (i == device_count) {
+		LOG_ERR("ERROR! INVALID CONNECTION!");
+		return BT_GATT_ITER_STOP;
+	}
+
+	LOG_ERR("[NOTIFICATION] from %d data %p length %u", i, data, length);
+//	LOG_HEXDUMP_ERR(data, length, "Value");
+
+#ifdef CONFIG_APP_TRACE
+	trace_add(i, params, data, length);
+#endif
+
+	notification_process(i, params, data, length);
+
+	return BT_GATT_ITER_CONTINUE;
+}
+
+/* Moves the state machine on once the current step, or every request of a batch, is done */
+static void step_complete(void)
+{
+#ifdef CONFIG_APP_EATT
+	if (atomic_get(&batch_pending) > 0 && atomic_dec(&batch_pending) != 1) {
+		return;
+	}
+#endif
+
+	k_work_submit_to_queue(&bt_work_q, &subscribe_workqueue);
+}
+
+static void subscribe_func(struct bt_conn *conn, uint8_t err,
+			   struct bt_gatt_subscribe_params *params)
+{
+	state_trace("subscribed", current_index, err);
+
+	if (err) {
+		int err;
+
+#ifdef CONFIG_APP_HANDLE_CACHE
+		/* Handles may have changed, discover them again on the next connection */
+		devices[current_index].handles_cached = false;
+#endif
+		LOG_ERR("Gonna matey");
+		err = bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	} else {
+		step_complete();
+	}
+}
+
+#ifdef CONFIG_APP_POLLING
+/* Returns true if a step finds a CCC descriptor, which reads do not need */
+static bool step_is_ccc(enum handle_status_t status)
+{
+	switch (status) {
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+		case FIND_TEMPERATURE_CCC:
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+		case FIND_HUMIDITY_CCC:
+#endif
+#ifdef CONFIG_APP_ESS_PRESSURE
+		case FIND_PRESSURE_CCC:
+#endif
+#ifdef CONFIG_APP_ESS_DEW_POINT_SUBSCRIBE
+		case FIND_DEW_POINT_CCC:
+#endif
+#ifdef CONFIG_APP_BATTERY_LEVEL
+		case FIND_BATTERY_LEVEL_CCC:
+#endif
+		{
+			return true;
+		}
+		default:
+		{
+			return false;
+		}
+	};
+}
+
+static uint8_t poll_read_func(struct bt_conn *conn, uint8_t err,
+			      struct bt_gatt_read_params *params, const void *data, uint16_t length)
+{
+	if (err) {
+		/* Handles may have changed, discover them again on the next poll */
+		LOG_ERR("Read failed (err %u)", err);
+		devices[current_index].handles_cached = false;
+		(void)bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+		return BT_GATT_ITER_STOP;
+	}
+
+	if (data != NULL) {
+		notification_process(current_index,
+				     CONTAINER_OF(params, struct poll_read, params)->subscription,
+				     data, length);
+		return BT_GATT_ITER_CONTINUE;
+	}
+
+	/* Read complete, move on to the next reading */
+	step_complete();
+
+	return BT_GATT_ITER_STOP;
+}
+#endif
+
+#ifdef CONFIG_APP_HANDLE_CACHE
+struct handle_cache_entry {
+	bt_addr_le_t address;
+	struct handle_cache cache;
+};
+
+/* Entries loaded from settings until they are matched to the roster, then entries being saved */
+static struct handle_cache_entry handle_cache_entries[DEVICE_SLOTS];
+static uint8_t handle_cache_loaded = 0;
+
+static void handle_cache_save(void)
+{
+	uint8_t count = 0;
+	uint8_t i = 0;
+	int err;
+
+	while (i < device_count) {
+		if (devices[i].handles_cached) {
+			bt_addr_le_copy(&handle_cache_entries[count].address, &devices[i].address);
+			memcpy(&handle_cache_entries[count].cache, &devices[i].cache,
+			       sizeof(struct handle_cache));
+			++count;
+		}
+
+		++i;
+	}
+
+	err = settings_save_one("app/handles", handle_cache_entries,
+				(count * sizeof(struct handle_cache_entry)));
+
+	if (err) {
+		LOG_ERR("Handle cache save failed: %d", err);
+	}
+}
+
+/* Keeps the handles of a device once it has been set up, saved only if they have changed */
+static void handle_cache_store(uint8_t index)
+{
+	struct handle_cache cache;
+	struct bt_gatt_subscribe_params *params;
+	uint8_t field = 0;
+
+	memset(&cache, 0, sizeof(cache));
+	cache.service = devices[index].handles.service;
+	cache.battery_service = devices[index].handles.battery_service;
+
+	while (field < READING_FIELDS) {
+		params = notification_params(index, field);
+
+		if (params != NULL) {
+			cache.value_handle[field] = params->value_handle;
+			cache.ccc_handle[field] = params->ccc_handle;
+		}
+
+		++field;
+	}
+
+	if (devices[index].handles_cached &&
+	    memcmp(&cache, &devices[index].cache, sizeof(cache)) == 0) {
+		return;
+	}
+
+	memcpy(&devices[index].cache, &cache, sizeof(cache));
+	devices[index].handles_cached = true;
+	handle_cache_save();
+}
+
+/* Puts the stored handles of a device back, unsubscribing on disconnection clears them. Returns
+ * false if they cannot be used
+ */
+static bool handle_cache_restore(uint8_t index)
+{
+	struct bt_gatt_subscribe_params *params;
+	uint8_t field = 0;
+
+	devices[index].handles.service = devices[index].cache.service;
+	devices[index].handles.battery_service = devices[index].cache.battery_service;
+
+	while (field < READING_FIELDS) {
+		params = notification_params(index, field);
+
+		if (params != NULL) {
+#ifndef CONFIG_APP_POLLING
+			/* Stored by a polling build, which does not discover CCC descriptors */
+			if (devices[index].cache.value_handle[field] != 0 &&
+			    devices[index].cache.ccc_handle[field] == 0) {
+				return false;
+			}
+#endif
+			params->value_handle = devices[index].cache.value_handle[field];
+			params->ccc_handle = devices[index].cache.ccc_handle[field];
+		}
+
+		++field;
+	}
+
+	return true;
+}
+#endif
+
+/* Returns the reading a subscribe step subscribes to (or reads), NULL for other steps */
+static struct bt_gatt_subscribe_params *step_subscription(uint8_t index,
+							  enum handle_status_t status)
+{
+	switch (status) {
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+		case SUBSCRIBE_TEMPERATURE:
+		{
+			return &devices[index].handles.temperature;
+		}
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+		case SUBSCRIBE_HUMDIITY:
+		{
+			return &devices[index].handles.humidity;
+		}
+#endif
+#ifdef CONFIG_APP_ESS_PRESSURE
+		case SUBSCRIBE_PRESSURE:
+		{
+			return &devices[index].handles.pressure;
+		}
+#endif
+#ifdef CONFIG_APP_ESS_DEW_POINT_SUBSCRIBE
+		case SUBSCRIBE_DEW_POINT:
+		{
+			return &devices[index].handles.dew_point;
+		}
+#endif
+#ifdef CONFIG_APP_BATTERY_LEVEL
+		case SUBSCRIBE_BATTERY_LEVEL:
+		{
+			return &devices[index].handles.battery_level;
+		}
+#endif
+		default:
+		{
+			return NULL;
+		}
+	};
+}
+
+/* Subscribes to a reading, or reads it when polling, using read parameters slot. Returns 0 if
+ * the request was sent and its callback completes the step
+ */
+static int step_issue(struct bt_conn *conn, struct bt_gatt_subscribe_params *param, uint8_t slot)
+{
+	int err;
+
+#ifdef CONFIG_APP_POLLING
+	if (param->value_handle == 0) {
+		/* Characteristic is not present on this device */
+		return -ENOENT;
+	}
+
+	/* Read the current value instead of subscribing */
+	poll_reads[slot].subscription = param;
+	poll_reads[slot].params.func = poll_read_func;
+	poll_reads[slot].params.handle_count = 1;
+	poll_reads[slot].params.single.handle = param->value_handle;
+	poll_reads[slot].params.single.offset = 0;
+
+	state_trace("read", current_index, devices[current_index].handles.status);
+	err = bt_gatt_read(conn, &poll_reads[slot].params);
+
+	if (err) {
+		LOG_ERR("Read failed (err %d)", err);
+	}
+#else
+	/* Subscribe for notifications */
+	param->subscribe = subscribe_func;
+	param->notify = notify_func;
+	param->value = BT_GATT_CCC_NOTIFY;
+
+	state_trace("subscribe", current_index, devices[current_index].handles.status);
+	err = bt_gatt_subscribe(conn, param);
+
+	if (err && err != -EALREADY) {
+		LOG_ERR("Subscribe failed (err %d)", err);
+	} else {
+		LOG_ERR("[SUBSCRIBED]");
+	}
+#endif
+
+	return err;
+}
+
+#ifdef CONFIG_APP_EATT
+/* Sends every remaining subscription (or read) of the device at once, the ATT layer spreads them
+ * over the enhanced bearers. The state machine continues once the last one has completed
+ */
+static void step_batch(struct bt_conn *conn)
+{
+	struct bt_gatt_subscribe_params *param;
+	uint8_t status = devices[current_index].handles.status;
+	uint8_t slot = 0;
+
+	/* Held until all requests are sent so that early completions cannot end the batch */
+	atomic_set(&batch_pending, 1);
+	state_trace("batch", current_index, bt_eatt_count(conn));
+
+	while (status < AWAITING_READINGS) {
+		param = step_subscription(current_index, status);
+
+		if (param != NULL) {
+			atomic_inc(&batch_pending);
+
+			if (step_issue(conn, param, slot) != 0) {
+				/* No callback follows, e.g. already subscribed or not present */
+				atomic_dec(&batch_pending);
+			}
+
+			++slot;
+		}
+
+		++status;
+	}
+
+	devices[current_index].handles.status = AWAITING_READINGS - 1;
+	state_watchdog_arm(K_MSEC(CONFIG_APP_WATCHDOG_SUBSCRIBE_TIMEOUT));
+	step_complete();
+}
+#endif
+
+static void next_action(struct bt_conn *conn, const struct bt_gatt_attr *attr)
+{
+	int err;
+	uint8_t action = 0;
+	uint8_t service = 0;
+	struct bt_gatt_subscribe_params *param = NULL;
+
+	/* Increment to next state */
+	++devices[current_index].handles.status;
+
+#ifdef CONFIG_APP_POLLING
+	while (step_is_ccc(devices[current_index].handles.status)) {
+		++devices[current_index].handles.status;
+	}
+#endif
+
+	if (devices[current_index].handles.status == AWAITING_READINGS) {
+#ifdef CONFIG_APP_POLLING
+		/* All readings have been read, the next device is polled once this one has
+		 * disconnected
+		 */
+		LOG_ERR("Poll finished!");
+		state_trace("polled", current_index, 0);
+		state_watchdog_cancel();
+		phy_link_succeeded(current_index);
+#ifdef CONFIG_APP_HANDLE_CACHE
+		handle_cache_store(current_index);
+#else
+		devices[current_index].handles_cached = true;
+#endif
+		err = bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+
+		if (err) {
+			LOG_ERR("Disconnect failed (err %d)", err);
+		}
+#else
+		/* Finished the setup state machine */
+		LOG_ERR("All finished!");
+		state_trace("active", current_index, 0);
+		state_watchdog_cancel();
+		phy_link_succeeded(current_index);
+#ifdef CONFIG_APP_HANDLE_CACHE
+		handle_cache_store(current_index);
+#endif
+		busy = false;
+		devices[current_index].state = STATE_ACTIVE;
+		devices[current_index].handles.status = AWAITING_READINGS;
+		k_sem_give(&next_action_sem);
+#endif
+		return;
+	}
+
+#ifdef CONFIG_APP_EATT
+	if (step_subscription(current_index, devices[current_index].handles.status) != NULL) {
+		if (bt_eatt_count(conn) > 0) {
+			/* Discovery steps depend on each other, subscriptions do not */
+			devices[current_index].eatt_unavailable = false;
+			eatt_waiting = false;
+			eatt_deadline = 0;
+			step_batch(conn);
+			return;
+		}
+
+		if (eatt_deadline != 0 && !eatt_failed && k_uptime_get() < eatt_deadline) {
+			/* Bearers are only set up once the link is encrypted, which can still be in
+			 * progress, so this step is retried until they are up or the deadline passes
+			 */
+			if (!eatt_waiting) {
+				eatt_waiting = true;
+				state_trace("eatt_wait", current_index, 0);
+				state_watchdog_arm(K_MSEC(CONFIG_APP_EATT_SETUP_TIMEOUT +
+							  CONFIG_APP_WATCHDOG_SUBSCRIBE_TIMEOUT));
+			}
+
+			--devices[current_index].handles.status;
+			(void)k_work_schedule_for_queue(&bt_work_q, &eatt_wait_work,
+							K_MSEC(EATT_WAIT_POLL_MS));
+			return;
+		}
+
+		/* No enhanced bearers, one request at a time on the unenhanced bearer. Once a wait
+		 * has run out the device is not waited for again, so later connections and polls
+		 * do not each pay for it
+		 */
+		if (eatt_deadline != 0) {
+			devices[current_index].eatt_unavailable = true;
+		}
+
+		eatt_waiting = false;
+		eatt_deadline = 0;
+	}
+#endif
+
+	switch (devices[current_index].handles.status) {
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+		case FIND_TEMPERATURE:
+		{
+			memcpy(&uuid, BT_UUID_TEMPERATURE, sizeof(uuid));
+			break;
+		}
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+		case FIND_HUMIDITY:
+		{
+			memcpy(&uuid, BT_UUID_HUMIDITY, sizeof(uuid));
+			break;
+		}
+#endif
+#ifdef CONFIG_APP_ESS_PRESSURE
+		case FIND_PRESSURE:
+		{
+			memcpy(&uuid, BT_UUID_PRESSURE, sizeof(uuid));
+			break;
+		}
+#endif
+#ifdef CONFIG_APP_ESS_DEW_POINT_SUBSCRIBE
+		case FIND_DEW_POINT:
+		{
+			memcpy(&uuid, BT_UUID_DEW_POINT, sizeof(uuid));
+			break;
+		}
+#endif
+#ifdef CONFIG_APP_BATTERY_LEVEL
+		case FIND_BATTERY_SERVICE:
+		{
+			memcpy(&uuid, BT_UUID_BAS, sizeof(uuid));
+			action = 1;
+			break;
+		}
+		case FIND_BATTERY_LEVEL:
+		{
+			memcpy(&uuid, BT_UUID_BAS_BATTERY_LEVEL, sizeof(uuid));
+			service = 1;
+			break;
+		}
+#endif
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+		case FIND_TEMPERATURE_CCC:
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+		case FIND_HUMIDITY_CCC:
+#endif
+#ifdef CONFIG_APP_ESS_PRESSURE
+		case FIND_PRESSURE_CCC:
+#endif
+#ifdef CONFIG_APP_ESS_DEW_POINT_SUBSCRIBE
+		case FIND_DEW_POINT_CCC:
+#endif
+#ifdef CONFIG_APP_BATTERY_LEVEL
+		case FIND_BATTERY_LEVEL_CCC:
+#endif
+		{
+			memcpy(&uuid, BT_UUID_GATT_CCC, sizeof(uuid));
+			action = 2;
+			break;
+		}
+		default:
+		{
+			param = step_subscription(current_index, devices[current_index].handles.status);
+
+			if (param != NULL) {
+				action = 3;
+				break;
+			}
+
+			LOG_ERR("Invalid state execution attempted: %d, maximum is %d (AWAITING_READINGS)", devices[current_index].handles.status, AWAITING_READINGS);
+			return;
+		}
+
+	};
+
+LOG_ERR("action is %d, state is %d", action, devices[current_index].handles.status);
+
+	if (action == 0) {
+		/* Find characteristic of service */
+		if (service == 0) {
+			discover_params.start_handle = devices[current_index].handles.service + 1;
+		} else {
+			discover_params.start_handle = devices[current_index].handles.battery_service + 1;
+		}
+		discover_params.type = BT_GATT_DISCOVER_CHARACTERISTIC;
+	} else if (action == 1) {
+		/* Find service */
+		discover_params.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
+		discover_params.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
+		discover_params.type = BT_GATT_DISCOVER_PRIMARY;
+	} else if (action == 2) {
+		/* Find descriptor of discovered characteristic */
+		discover_params.start_handle = attr->handle + 2;
+		discover_params.type = BT_GATT_DISCOVER_DESCRIPTOR;
+	} else if (action == 3) {
+		err = step_issue(conn, param, 0);
+
+		if (err == -ENOENT) {
+			step_complete();
+			return;
+		}
+
+		state_watchdog_arm(K_MSEC(CONFIG_APP_WATCHDOG_SUBSCRIBE_TIMEOUT));
+	}
+
+	if (action == 0 || action == 1 || action == 2) {
+		state_trace("discover", current_index, devices[current_index].handles.status);
+		discover_params.uuid = &uuid.uuid;
+		err = bt_gatt_discover(conn, &discover_params);
+
+		if (err) {
+			LOG_ERR("Discover failed (err %d)", err);
+		}
+
+		state_watchdog_arm(K_MSEC(CONFIG_APP_WATCHDOG_DISCOVER_TIMEOUT));
+	}
+}
+
+static void subscribe_work(struct k_work *work)
+{
+	next_action(devices[current_index].connection, NULL);
+}
+
+#ifdef CONFIG_APP_EATT
+/* Retries the first subscription step whilst waiting for enhanced bearers */
+static void eatt_wait(struct k_work *work)
+{
+	if (devices[current_index].connection == NULL ||
+	    devices[current_index].state < STATE_CONNECTED) {
+		return;
+	}
+
+	next_action(devices[current_index].connection, NULL);
+}
+
+static void security_changed(struct bt_conn *conn, bt_security_t level,
+			     enum bt_security_err err)
+{
+	if (devices[current_index].connection != conn || !err) {
+		return;
+	}
+
+	/* No enhanced bearers will follow, stop waiting for them */
+	LOG_ERR("Security failed (err %d)", err);
+	eatt_failed = true;
+
+	if (eatt_waiting) {
+		(void)k_work_reschedule_for_queue(&bt_work_q, &eatt_wait_work, K_NO_WAIT);
+	}
+}
+#endif
+
+static uint8_t discover_func(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+			     struct bt_gatt_discover_params *params)
+{
+	int err = 0;
+
+	if (!attr) {
+		/* Nothing found, the device stays in this step until the watchdog expires */
+		LOG_ERR("Discover complete");
+		state_trace("discover_empty", current_index, devices[current_index].handles.status);
+		(void)memset(params, 0, sizeof(*params));
+		return BT_GATT_ITER_STOP;
+	}
+
+	LOG_ERR("[ATTRIBUTE] handle %u", attr->handle);
+	state_trace("discovered", current_index, attr->handle);
+
+	if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_ESS)) {
+		devices[current_index].state = STATE_DISCOVERING;
+		devices[current_index].handles.service = attr->handle;
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_TEMPERATURE)) {
+		devices[current_index].handles.temperature.value_handle =
+								bt_gatt_attr_value_handle(attr);
+	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_GATT_CCC) &&
+		   devices[current_index].handles.status == FIND_TEMPERATURE_CCC) {
+		devices[current_index].handles.temperature.ccc_handle = attr->handle;
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_HUMIDITY)) {
+		devices[current_index].handles.humidity.value_handle =
+								bt_gatt_attr_value_handle(attr);
+	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_GATT_CCC) &&
+		   devices[current_index].handles.status == FIND_HUMIDITY_CCC) {
+		devices[current_index].handles.humidity.ccc_handle = attr->handle;
+#endif
+#ifdef CONFIG_APP_ESS_PRESSURE
+	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_PRESSURE)) {
+		devices[current_index].handles.pressure.value_handle =
+								bt_gatt_attr_value_handle(attr);
+	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_GATT_CCC) &&
+		   devices[current_index].handles.status == FIND_PRESSURE_CCC) {
+		devices[current_index].handles.pressure.ccc_handle = attr->handle;
+#endif
+#ifdef CONFIG_APP_ESS_DEW_POINT_SUBSCRIBE
+	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_DEW_POINT)) {
+		devices[current_index].handles.dew_point.value_handle =
+								bt_gatt_attr_value_handle(attr);
+	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_GATT_CCC) &&
+		   devices[current_index].handles.status == FIND_DEW_POINT_CCC) {
+		devices[current_index].handles.dew_point.ccc_handle = attr->handle;
+#endif
+#ifdef CONFIG_APP_BATTERY_LEVEL
+	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_BAS)) {
+		devices[current_index].handles.battery_service = attr->handle;
+	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_BAS_BATTERY_LEVEL)) {
+		devices[current_index].handles.battery_level.value_handle =
+								bt_gatt_attr_value_handle(attr);
+	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_GATT_CCC) &&
+		   devices[current_index].handles.status == FIND_BATTERY_LEVEL_CCC) {
+		devices[current_index].handles.battery_level.ccc_handle = attr->handle;
+#endif
+	}
+
+	if (err) {
+		err = bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	} else {
+		next_action(conn, attr);
+	}
+
+	return BT_GATT_ITER_STOP;
+}
+
+static void connected(struct bt_conn *conn, uint8_t conn_err)
+{
+	char addr[BT_ADDR_LE_STR_LEN];
+	int err;
+#if defined(CONFIG_APP_ADAPTIVE_PHY) || defined(CONFIG_APP_CONN_PLANNER)
+	struct bt_conn_info info;
+#endif
+
+	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+
+#ifdef CONFIG_APP_GATT_SERVER
+	if (server_connection(conn)) {
+		LOG_ERR("Client connected: %s (%u)", addr, conn_err);
+		return;
+	}
+#endif
+
+	if (devices[current_index].state != STATE_CONNECTING ||
+	    bt_addr_le_cmp(bt_conn_get_dst(conn), &devices[current_index].address) != 0) {
+		/* Late result of a connection attempt which the watchdog gave up on */
+		LOG_ERR("Stale connection to %s (%u)", addr, conn_err);
+		state_trace("stale", current_index, conn_err);
+
+		if (conn_err) {
+			bt_conn_unref(conn);
+		} else {
+			(void)bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+		}
+
+		return;
+	}
+
+	if (conn_err) {
+		LOG_ERR("Failed to connect to %s (%u)", addr, conn_err);
+		state_trace("connect_failed", current_index, conn_err);
+
+		/* Mark as not busy and advance state machine */
+		state_watchdog_cancel();
+		poll_deadline_cancel();
+		bt_conn_unref(conn);
+		devices[current_index].state = STATE_IDLE;
+		devices[current_index].connection = NULL;
+		++devices[current_index].stats.failures;
+		phy_link_failed(current_index);
+		busy = false;
+
+		if (connection_failures < 30) {
+			++connection_failures;
+		}
+
+		++current_index;
+
+		if (current_index >= device_count) {
+			current_index = 0;
+		}
+
+		k_sem_give(&next_action_sem);
+
+		return;
+	}
+
+	connection_failures = 0;
+	state_trace("connected", current_index, 0);
+
+	devices[current_index].state = STATE_CONNECTED;
+	++devices[current_index].stats.connections;
+
+#ifdef CONFIG_APP_ADAPTIVE_PHY
+	/* The connection is on whichever PHY the device was reached on */
+	if (bt_conn_get_info(conn, &info) == 0) {
+		devices[current_index].phy = info.le.phy->tx_phy;
+	}
+#endif
+
+#ifdef CONFIG_APP_CONN_PLANNER
+	if (bt_conn_get_info(conn, &info) == 0) {
+		devices[current_index].plan.interval = info.le.interval;
+	}
+#endif
+
+#ifdef CONFIG_APP_TX_POWER
+	tx_power_connected(current_index);
+#endif
+
+#ifdef CONFIG_APP_EATT
+	/* Enhanced bearers are set up once the link is encrypted, subscriptions wait for them */
+	atomic_set(&batch_pending, 0);
+	eatt_waiting = false;
+	eatt_failed = false;
+	eatt_deadline = (devices[current_index].eatt_unavailable ? 0 :
+			 (k_uptime_get() + CONFIG_APP_EATT_SETUP_TIMEOUT));
+	err = bt_conn_set_security(conn, BT_SECURITY_L2);
+
+	if (err) {
+		LOG_ERR("Security request failed (err %d)", err);
+		eatt_deadline = 0;
+	}
+#endif
+
+#if defined(CONFIG_APP_POLLING) || defined(CONFIG_APP_HANDLE_CACHE)
+#ifdef CONFIG_APP_HANDLE_CACHE
+	if (devices[current_index].handles_cached && !handle_cache_restore(current_index)) {
+		devices[current_index].handles_cached = false;
+	}
+#endif
+
+	if (devices[current_index].handles_cached) {
+		/* Skip discovery and continue from the first read or subscription */
+		devices[current_index].handles.status = DISCOVERY_LAST_STEP;
+		next_action(conn, NULL);
+		return;
+	}
+#endif
+
+	memset(&devices[current_index].handles, 0, sizeof(struct device_handles));
+
+	LOG_ERR("Connected: %s", addr);
+
+	memcpy(&uuid, BT_UUID_ESS, sizeof(uuid));
+	devices[current_index].handles.status = FIND_ESS_SERVICE;
+
+	discover_params.uuid = &uuid.uuid;
+	discover_params.func = discover_func;
+	discover_params.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
+	discover_params.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
+	discover_params.type = BT_GATT_DISCOVER_PRIMARY;
+
+	err = bt_gatt_discover(conn, &discover_params);
+
+	if (err) {
+		LOG_ERR("Discover failed(err %d)", err);
+		err = bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	}
+
+	state_watchdog_arm(K_MSEC(CONFIG_APP_WATCHDOG_DISCOVER_TIMEOUT));
+}
+
+static void disconnected(struct bt_conn *conn, uint8_t reason)
+{
+	uint8_t i = 0;
+	char addr[BT_ADDR_LE_STR_LEN];
+	bool increment = false;
+
+	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+
+	LOG_ERR("Disconnected: %s (reason 0x%02x)", addr, reason);
+
+#ifdef CONFIG_APP_GATT_SERVER
+	if (server_connection(conn)) {
+		/* Advertising is resumed once the connection object is recycled */
+		return;
+	}
+#endif
+
+	/* Check if this was the device currently being serviced */
+	if (devices[current_index].connection == conn) {
+		i = current_index;
+		increment = true;
+
+		if (devices[i].state != STATE_ACTIVE && busy) {
+			/* We are no longer busy, allow state machine to connect to next device */
+			state_watchdog_cancel();
+			poll_deadline_cancel();
+			busy = false;
+		}
+
+#ifdef CONFIG_APP_EATT
+		(void)k_work_cancel_delayable(&eatt_wait_work);
+		eatt_waiting = false;
+#endif
+	}
+
+	/* Search for the instance */
+	while (i < device_count) {
+		if (devices[i].connection == conn) {
+			state_trace("disconnected", i, reason);
+
+			if (devices[i].state == STATE_ACTIVE) {
+				/* Reset connection failure count to allow fast reconnection to device */
+				connection_failures = 0;
+			}
+
+			devices[i].state = STATE_IDLE;
+			devices[i].connection = NULL;
+			devices[i].handles.status = 0;
+			++devices[i].stats.disconnects;
+
+			if (reason == BT_HCI_ERR_CONN_TIMEOUT) {
+				++devices[i].stats.link_losses;
+			}
+			/* Polling keeps readings between connections, their age shows how current
+			 * they are
+			 */
+#ifndef CONFIG_APP_POLLING
+			memset(&devices[i].readings, 0, sizeof(struct device_readings));
+			readings_publish(i);
+			pipeline_publish(i, RECEIVED_NONE, &devices[i].readings);
+#endif
+			break;
+		}
+
+		++i;
+	}
+
+	if (increment) {
+		++current_index;
+
+		if (current_index >= device_count) {
+			current_index = 0;
+		}
+	}
+
+	bt_conn_unref(conn);
+	k_sem_give(&next_action_sem);
+}
+
+BT_CONN_CB_DEFINE(conn_callbacks) = {
+	.connected = connected,
+	.disconnected = disconnected,
+#ifdef CONFIG_APP_GATT_SERVER
+	.recycled = recycled,
+#endif
+#ifdef CONFIG_APP_ADAPTIVE_PHY
+	.le_phy_updated = le_phy_updated,
+#endif
+#ifdef CONFIG_APP_EATT
+	.security_changed = security_changed,
+#endif
+#ifdef CONFIG_APP_CONN_PLANNER
+	.le_param_req = le_param_req,
+	.le_param_updated = le_param_updated,
+#endif
+};
+
+#ifdef CONFIG_APP_ROSTER_SETTINGS
+struct roster_entry {
+	bt_addr_le_t address;
+	char name[DEVICE_NAME_MAX + 1];
+};
+
+static int roster_settings_set(const char *key, size_t len, settings_read_cb read_cb,
+			       void *cb_arg)
+{
+	struct roster_entry entries[DEVICE_SLOTS];
+	ssize_t size;
+	uint8_t i = 0;
+
+	if (strcmp(key, "roster") != 0) {
+		return -ENOENT;
+	}
+
+	if (len > sizeof(entries) || (len % sizeof(struct roster_entry)) != 0) {
+		return -EINVAL;
+	}
+
+	size = read_cb(cb_arg, entries, len);
+
+	if (size < 0) {
+		return (int)size;
+	}
+
+	memset(devices, 0, sizeof(devices));
+
+	if ((size / sizeof(struct roster_entry)) > ROSTER_DEVICES_MAX) {
+		LOG_ERR("Roster has more devices than links, only the first %d are kept",
+			ROSTER_DEVICES_MAX);
+		size = (ROSTER_DEVICES_MAX * sizeof(struct roster_entry));
+	}
+
+	while (i < (size / sizeof(struct roster_entry))) {
+		bt_addr_le_copy(&devices[i].address, &entries[i].address);
+		memcpy(devices[i].name, entries[i].name, DEVICE_NAME_MAX);
+		++i;
+	}
+
+	device_count = i;
+
+	return 0;
+}
+
+#ifdef CONFIG_APP_HANDLE_CACHE
+static int handle_cache_settings_set(size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+	ssize_t size;
+
+	if (len > sizeof(handle_cache_entries) || (len % sizeof(struct handle_cache_entry)) != 0) {
+		return -EINVAL;
+	}
+
+	size = read_cb(cb_arg, handle_cache_entries, len);
+
+	if (size < 0) {
+		return (int)size;
+	}
+
+	handle_cache_loaded = (uint8_t)(size / sizeof(struct handle_cache_entry));
+
+	return 0;
+}
+
+/* Matches loaded handles to the roster, which can be loaded in either order */
+static int app_settings_commit(void)
+{
+	uint8_t i = 0;
+
+	while (i < handle_cache_loaded) {
+		uint8_t index = 0;
+
+		while (index < device_count) {
+			if (bt_addr_le_cmp(&devices[index].address,
+					   &handle_cache_entries[i].address) == 0) {
+				memcpy(&devices[index].cache, &handle_cache_entries[i].cache,
+				       sizeof(struct handle_cache));
+				devices[index].handles_cached = true;
+				break;
+			}
+
+			++index;
+		}
+
+		++i;
+	}
+
+	handle_cache_loaded = 0;
+
+	return 0;
+}
+#endif
+
+#ifdef CONFIG_APP_HISTORY
+static int history_settings_set(size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+	ssize_t size;
+
+	if (len != sizeof(history_acknowledged)) {
+		return -EINVAL;
+	}
+
+	size = read_cb(cb_arg, &history_acknowledged, len);
+
+	return (size < 0 ? (int)size : 0);
+}
+#endif
+
+#ifdef CONFIG_APP_ALARMS
+static int alarm_settings_set(size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+	ssize_t size;
+
+	if (len != sizeof(alarm_rules)) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&alarm_lock, K_FOREVER);
+	size = read_cb(cb_arg, alarm_rules, len);
+	k_mutex_unlock(&alarm_lock);
+
+	return (size < 0 ? (int)size : 0);
+}
+#endif
+
+static int app_settings_set(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+#ifdef CONFIG_APP_HANDLE_CACHE
+	if (strcmp(key, "handles") == 0) {
+		return handle_cache_settings_set(len, read_cb, cb_arg);
+	}
+#endif
+
+#ifdef CONFIG_APP_ALARMS
+	if (strcmp(key, "alarms") == 0) {
+		return alarm_settings_set(len, read_cb, cb_arg);
+	}
+#endif
+
+#ifdef CONFIG_APP_HISTORY
+	if (strcmp(key, "history") == 0) {
+		return history_settings_set(len, read_cb, cb_arg);
+	}
+#endif
+
+	return roster_settings_set(key, len, read_cb, cb_arg);
+}
+
+#ifdef CONFIG_APP_HANDLE_CACHE
+SETTINGS_STATIC_HANDLER_DEFINE(app, "app", NULL, app_settings_set, app_settings_commit, NULL);
+#else
+SETTINGS_STATIC_HANDLER_DEFINE(app, "app", NULL, app_settings_set, NULL, NULL);
+#endif
+
+static void roster_save(void)
+{
+	struct roster_entry entries[DEVICE_SLOTS];
+	uint8_t i = 0;
+	int err;
+
+	memset(entries, 0, sizeof(entries));
+
+	while (i < device_count) {
+		bt_addr_le_copy(&entries[i].address, &devices[i].address);
+		memcpy(entries[i].name, devices[i].name, DEVICE_NAME_MAX);
+		++i;
+	}
+
+	err = settings_save_one("app/roster", entries, (device_count * sizeof(struct roster_entry)));
+
+	if (err) {
+		LOG_ERR("Roster save failed: %d", err);
+	}
+}
+#else
+#define roster_save()
+#endif
+
+/* Adds a device to the end of the roster, returns the index of the device or a negative error
+ * code
+ */
+static int roster_add(const bt_addr_le_t *address, const char *name)
+{
+	uint8_t i = 0;
+
+	while (i < device_count) {
+		if (bt_addr_le_cmp(&devices[i].address, address) == 0) {
+			return -EALREADY;
+		}
+
+		++i;
+	}
+
+	if (device_count >= ROSTER_DEVICES_MAX) {
+		return -ENOMEM;
+	}
+
+	memset(&devices[i], 0, sizeof(struct device_params));
+	bt_addr_le_copy(&devices[i].address, address);
+
+	if (name != NULL && name[0] != '\0') {
+		strncpy(devices[i].name, name, DEVICE_NAME_MAX);
+	} else {
+		snprintf(devices[i].name, sizeof(devices[i].name), "Sensor %d",
+			 (device_id_value_offset + i));
+	}
+
+	devices[i].state = STATE_IDLE;
+	++device_count;
+	roster_save();
+	k_sem_give(&next_action_sem);
+
+	return i;
+}
+
+/* Moves the entries after a removed device of an array indexed by device down by one */
+static void roster_array_remove(void *array, size_t size, uint8_t index)
+{
+	uint8_t *entries = array;
+
+	memmove(&entries[index * size], &entries[(index + 1) * size],
+		((device_count - index - 1) * size));
+	memset(&entries[(device_count - 1) * size], 0, size);
+}
+
+/* Removes an idle device from the roster whilst the application is disabled */
+static int roster_remove(uint8_t index)
+{
+	uint8_t i = 0;
+
+	if (index >= device_count) {
+		return -EINVAL;
+	}
+
+	if (!disabled) {
+		return -EBUSY;
+	}
+
+	/* Later devices are moved, along with subscriptions the host may still have linked */
+	while (i < device_count) {
+		if (devices[i].state != STATE_IDLE || devices[i].connection != NULL) {
+			return -EBUSY;
+		}
+
+		++i;
+	}
+
+	roster_array_remove(devices, sizeof(devices[0]), index);
+	roster_array_remove(shell_readings_output, sizeof(shell_readings_output[0]), index);
+#ifdef CONFIG_APP_BROADCAST
+	roster_array_remove(broadcast_readings_output, sizeof(broadcast_readings_output[0]),
+			    index);
+#endif
+#ifdef CONFIG_APP_GATT_SERVER
+	roster_array_remove(server_readings_output, sizeof(server_readings_output[0]), index);
+#endif
+#ifdef CONFIG_APP_TELEMETRY
+	roster_array_remove(telemetry_readings_output, sizeof(telemetry_readings_output[0]),
+			    index);
+#endif
+#ifdef CONFIG_APP_HISTORY
+	roster_array_remove(history_readings_output, sizeof(history_readings_output[0]), index);
+#endif
+#ifdef CONFIG_APP_AGGREGATES
+	k_mutex_lock(&aggregate_lock, K_FOREVER);
+	roster_array_remove(aggregates, sizeof(aggregates[0]), index);
+	k_mutex_unlock(&aggregate_lock);
+#endif
+	--device_count;
+	current_index = 0;
+	output_rows_clear();
+	roster_save();
+
+	return 0;
+}
+
+/* Parses an address in the format output by "ess status", the type followed by the address */
+static int address_parse(const char *text, bt_addr_le_t *address)
+{
+	uint8_t buffer[7];
+	uint8_t i = 0;
+
+	if (strlen(text) != (sizeof(buffer) * 2) ||
+	    hex2bin(text, strlen(text), buffer, sizeof(buffer)) != sizeof(buffer)) {
+		return -EINVAL;
+	}
+
+	address->type = buffer[0];
+
+	while (i < sizeof(address->a.val)) {
+		address->a.val[i] = buffer[(sizeof(buffer) - 1) - i];
+		++i;
+	}
+
+	return 0;
+}
+
+#ifdef CONFIG_APP_SCAN
+struct scan_result {
+	bt_addr_le_t address;
+	char name[DEVICE_NAME_MAX + 1];
+	int32_t rssi_total;
+	uint16_t adverts;
+};
+
+struct scan_parse {
+	bool ess;
+	char name[DEVICE_NAME_MAX + 1];
+};
+
+static struct scan_result scan_results[CONFIG_APP_SCAN_RESULTS];
+static uint8_t scan_result_count = 0;
+static uint32_t scan_duration = 0;
+static struct k_work_delayable scan_stop_work;
+
+static bool scan_parse_data(struct bt_data *data, void *user_data)
+{
+	struct scan_parse *parse = user_data;
+	uint8_t i = 0;
+
+	switch (data->type) {
+		case BT_DATA_UUID16_SOME:
+		case BT_DATA_UUID16_ALL:
+		{
+			while ((i + 1) < data->data_len) {
+				if (sys_get_le16(&data->data[i]) == BT_UUID_ESS_VAL) {
+					parse->ess = true;
+				}
+
+				i += 2;
+			}
+
+			break;
+		}
+		case BT_DATA_SVC_DATA16:
+		{
+			if (data->data_len >= 2 && sys_get_le16(data->data) == BT_UUID_ESS_VAL) {
+				parse->ess = true;
+			}
+
+			break;
+		}
+		case BT_DATA_NAME_SHORTENED:
+		case BT_DATA_NAME_COMPLETE:
+		{
+			i = MIN(data->data_len, DEVICE_NAME_MAX);
+			memcpy(parse->name, data->data, i);
+			parse->name[i] = '\0';
+			break;
+		}
+		default:
+		{
+			break;
+		}
+	};
+
+	return true;
+}
+
+static void scan_received(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
+			  struct net_buf_simple *ad)
+{
+	struct scan_parse parse = { 0 };
+	uint8_t i = 0;
+
+	bt_data_parse(ad, scan_parse_data, &parse);
+
+	if (!parse.ess) {
+		return;
+	}
+
+	while (i < scan_result_count) {
+		if (bt_addr_le_cmp(&scan_results[i].address, addr) == 0) {
+			break;
+		}
+
+		++i;
+	}
+
+	if (i == scan_result_count) {
+		if (i >= ARRAY_SIZE(scan_results)) {
+			return;
+		}
+
+		memset(&scan_results[i], 0, sizeof(struct scan_result));
+		bt_addr_le_copy(&scan_results[i].address, addr);
+		++scan_result_count;
+	}
+
+	scan_results[i].rssi_total += rssi;
+	++scan_results[i].adverts;
+
+	if (parse.name[0] != '\0') {
+		memcpy(scan_results[i].name, parse.name, sizeof(parse.name));
+	}
+}
+
+static int8_t scan_average_rssi(const struct scan_result *result)
+{
+	return (int8_t)(result->rssi_total / result->adverts);
+}
+
+/* Returns true if result a ranks above result b. Devices are ranked by average RSSI in 5 dBm
+ * bands, then by advertising rate (all results cover the same scan period)
+ */
+static bool scan_ranks_above(const struct scan_result *a, const struct scan_result *b)
+{
+	int8_t band_a = scan_average_rssi(a) / 5;
+	int8_t band_b = scan_average_rssi(b) / 5;
+
+	if (band_a != band_b) {
+		return (band_a > band_b);
+	}
+
+	return (a->adverts > b->adverts);
+}
+
+static void scan_sort(void)
+{
+	uint8_t i = 1;
+
+	while (i < scan_result_count) {
+		struct scan_result result = scan_results[i];
+		uint8_t l = i;
+
+		while (l > 0 && scan_ranks_above(&result, &scan_results[l - 1])) {
+			scan_results[l] = scan_results[l - 1];
+			--l;
+		}
+
+		scan_results[l] = result;
+		++i;
+	}
+}
+
+static void scan_stop(struct k_work *work)
+{
+	int err;
+
+	if (!scanning) {
+		return;
+	}
+
+	err = bt_le_scan_stop();
+
+	if (err) {
+		LOG_ERR("Scan stop failed: %d", err);
+	}
+
+	scan_sort();
+	scanning = false;
+
+#ifdef CONFIG_APP_SCAN_AUTO_ADOPT
+	uint8_t i = 0;
+
+	while (i < scan_result_count) {
+		if (scan_average_rssi(&scan_results[i]) >= CONFIG_APP_SCAN_AUTO_ADOPT_RSSI &&
+		    scan_results[i].adverts >= CONFIG_APP_SCAN_AUTO_ADOPT_ADVERTS) {
+			err = roster_add(&scan_results[i].address, scan_results[i].name);
+
+			if (err == -ENOMEM) {
+				break;
+			} else if (err >= 0) {
+				LOG_ERR("Adopted %s as #%d", scan_results[i].name,
+					(device_id_value_offset + err));
+			}
+		}
+
+		++i;
+	}
+#endif
+
+	k_sem_give(&next_action_sem);
+}
+#endif
+
+/* Returns true if a device should be connected to */
+static bool device_due(uint8_t index)
+{
+#ifdef CONFIG_APP_POLLING
+	return (devices[index].state == STATE_IDLE && devices[index].poll_due <= k_uptime_get());
+#else
+	return (devices[index].state == STATE_IDLE);
+#endif
+}
+
+#ifdef CONFIG_APP_POLLING
+/* Returns the time until the next device is due to be polled */
+static k_timeout_t poll_wait(void)
+{
+	uint8_t i = 0;
+	int64_t next = INT64_MAX;
+
+	if (disabled || busy || scanning) {
+		return K_FOREVER;
+	}
+
+	while (i < device_count) {
+		if (devices[i].state == STATE_IDLE && devices[i].poll_due < next) {
+			next = devices[i].poll_due;
+		}
+
+		++i;
+	}
+
+	if (next == INT64_MAX) {
+		return K_FOREVER;
+	}
+
+	next -= k_uptime_get();
+
+	return (next > 0 ? K_MSEC(next) : K_NO_WAIT);
+}
+#else
+#define poll_wait() K_FOREVER
+#endif
+
+static void sensor_function(void *, void *, void *)
+{
+	int err;
+	struct bt_le_conn_param *param = BT_LE_CONN_PARAM_DEFAULT;
+	const struct bt_conn_le_create_param *create = BT_CONN_LE_CREATE_CONN;
+#ifdef CONFIG_APP_ADAPTIVE_PHY
+	/* Also initiates on LE Coded, for devices which advertise on it */
+	const struct bt_conn_le_create_param *create_coded =
+		BT_CONN_LE_CREATE_PARAM(BT_CONN_LE_OPT_CODED, BT_GAP_SCAN_FAST_INTERVAL,
+					BT_GAP_SCAN_FAST_INTERVAL);
+#endif
+#ifdef CONFIG_APP_CONN_PLANNER
+	struct bt_le_conn_param conn_param;
+	struct bt_conn_le_create_param create_param = { 0 };
+#endif
+
+	while (1) {
+		(void)k_sem_take(&next_action_sem, poll_wait());
+
+		if (disabled || busy || scanning || !bluetooth_ready) {
+			continue;
+		}
+
+		/* Check if there are any devices with states that require attention */
+		uint8_t i = 0;
+		while (i < device_count) {
+			if (device_due(i)) {
+				break;
+			}
+
+			++i;
+		}
+
+		if (i == device_count) {
+			continue;
+		}
+
+		while (!device_due(current_index)) {
+			++current_index;
+
+			if (current_index >= device_count) {
+				current_index = 0;
+			}
+		}
+
+		busy = true;
+		devices[current_index].state = STATE_CONNECTING;
+		state_trace("backoff", current_index, connection_failures);
+
+#ifdef CONFIG_APP_POLLING
+		/* Polls start once per period regardless of the outcome of this one */
+		devices[current_index].poll_due = k_uptime_get() +
+						  ((int64_t)CONFIG_APP_POLL_PERIOD * MSEC_PER_SEC);
+#endif
+
+		/* If we have problems connecting then delay new connection attempts as the device is likely offline */
+		if (connection_failures >= 28) {
+			k_sleep(K_SECONDS(10));
+		} else if (connection_failures > 16) {
+			k_sleep(K_SECONDS(4));
+		} else if (connection_failures > 8) {
+			k_sleep(K_MSEC(800));
+		}
+
+		state_trace("connecting", current_index, 0);
+#ifdef CONFIG_APP_ADAPTIVE_PHY
+		create = (phy_choose(current_index, RSSI_UNKNOWN) == BT_GAP_LE_PHY_CODED ?
+			  create_coded : BT_CONN_LE_CREATE_CONN);
+#endif
+#ifdef CONFIG_APP_CONN_PLANNER
+		/* Same options, with the planned interval and a scan window between links */
+		(void)plan_link(current_index, &conn_param, &create_param);
+		create_param.options = create->options;
+		create = &create_param;
+		param = &conn_param;
+#endif
+		err = bt_conn_le_create(&devices[current_index].address, create, param,
+					&devices[current_index].connection);
+
+		if (err) {
+			LOG_ERR("Got error: %d", err);
+			state_trace("connect_failed", current_index, err);
+			devices[current_index].state = STATE_IDLE;
+			++devices[current_index].stats.failures;
+			phy_link_failed(current_index);
+			busy = false;
+
+			if (connection_failures < 30) {
+				++connection_failures;
+			}
+
+			++current_index;
+
+			if (current_index >= device_count) {
+				current_index = 0;
+			}
+
+			k_sem_give(&next_action_sem);
+		} else {
+			state_watchdog_arm(K_MSEC(CONFIG_APP_WATCHDOG_CONNECT_TIMEOUT));
+			poll_deadline_arm();
+		}
+	}
+}
+
+/* Drives the fan at a speed, stopped and full speed use GPIO mode with the PWM suspended */
+static void fan_output(uint8_t speed, bool half)
+{
+	int err;
+
+	if (speed == 0 || (speed == FAN_SPEED_MAX && half == false)) {
+		if (pwm_enabled) {
+			err = pwm_set_dt(&fan_pwm, PWM_MAX_PERIOD, 0);
+			err = pm_device_action_run(fan_pwm.dev, PM_DEVICE_ACTION_SUSPEND);
+
+			if (!err) {
+				pwm_enabled = false;
+			} else {
+				LOG_ERR("PWM disable failed: %d", err);
+			}
+		}
+
+		err = gpio_pin_configure_dt(&fan_pin, (speed == 0 ? GPIO_OUTPUT_INACTIVE :
+						       GPIO_OUTPUT_ACTIVE) | NRF_GPIO_DRIVE_H0H1);
+
+		if (err) {
+			LOG_ERR("GPIO configure failed: %d", err);
+		}
+
+		return;
+	}
+
+	if (!pwm_enabled) {
+		err = gpio_pin_configure_dt(&fan_pin, GPIO_OUTPUT_INACTIVE);
+		err = pm_device_action_run(fan_pwm.dev, PM_DEVICE_ACTION_RESUME);
+
+		if (!err) {
+			pwm_enabled = true;
+		} else {
+			LOG_ERR("PWM enable failed: %d", err);
+		}
+	}
+
+	err = pwm_set_dt(&fan_pwm, PWM_MAX_PERIOD, (PWM_MAX_PERIOD * speed / (half == true ? 200U : 100U)));
+
+	if (err) {
+		LOG_ERR("PWM set failed: %d (speed: %d)", err, speed);
+	}
+}
+
+/* Shapes the progress of a ramp, both in Q16 (0 to 65536) */
+static uint32_t fan_curve_apply(enum fan_curve curve, uint32_t progress)
+{
+	uint64_t squared = ((uint64_t)progress * progress) >> 16;
+
+	switch (curve) {
+		case FAN_CURVE_S:
+		{
+			/* Smoothstep, 3p^2 - 2p^3 */
+			return (uint32_t)((squared * ((3U << 16) - (2U * progress))) >> 16);
+		}
+		case FAN_CURVE_SOFT:
+		{
+			return (uint32_t)squared;
+		}
+		default:
+		{
+			return progress;
+		}
+	};
+}
+
+/* Gets the speed a ramp has reached, sets done once the target has been reached */
+static uint8_t fan_ramp_level(const struct fan_ramp *ramp, uint8_t target, bool *done)
+{
+	int64_t elapsed = k_uptime_get() - ramp->started;
+	uint32_t progress;
+
+	if (elapsed >= ramp->duration) {
+		*done = true;
+		return target;
+	}
+
+	*done = false;
+	progress = fan_curve_apply(ramp->curve, (uint32_t)((elapsed << 16) / ramp->duration));
+
+	return (uint8_t)((int32_t)ramp->start +
+			 (((int32_t)target - (int32_t)ramp->start) * (int32_t)progress) / 65536);
+}
+
+/* Waits for speed requests and ramps towards the latest one on each tick, a new request takes
+ * over from wherever the current ramp has got to
+ */
+static void fan_function(void *, void *, void *)
+{
+	const struct zbus_channel *channel;
+	struct fan_request request;
+	struct fan_ramp ramp = { 0 };
+	bool done = true;
+	uint8_t level;
+
+	while (1) {
+		if (zbus_sub_wait(&fan_subscriber, &channel,
+				  (done ? K_FOREVER : K_MSEC(FAN_RAMP_TICK_MS))) == 0) {
+			if (zbus_chan_read(&fan_chan, &request, K_FOREVER) != 0) {
+				continue;
+			}
+
+			fan_speed = request.speed;
+			half_fan_speed = request.half;
+			ramp.start = current_fan_speed;
+			ramp.started = k_uptime_get();
+			ramp.curve = request.curve;
+
+			if (fan_speed == 0 || request.slew_rate == 0) {
+				/* Stopping is immediate, as before */
+				ramp.duration = 0;
+			} else {
+				ramp.duration = ((uint32_t)(fan_speed > current_fan_speed ?
+							    (fan_speed - current_fan_speed) :
+							    (current_fan_speed - fan_speed)) *
+						 MSEC_PER_SEC) / request.slew_rate;
+			}
+		}
+
+		if (!pwm_is_ready_dt(&fan_pwm)) {
+			LOG_ERR("Fan PWM is not ready");
+			done = true;
+			continue;
+		}
+
+		level = fan_ramp_level(&ramp, fan_speed, &done);
+
+		if (level != current_fan_speed || half_fan_speed != current_half_fan_speed) {
+			fan_output(level, half_fan_speed);
+			current_fan_speed = level;
+			current_half_fan_speed = half_fan_speed;
+		}
+	}
+}
+
+/* Finishes boot once both Bluetooth and the roster are ready, as advertising, the broadcast and
+ * connecting all use the roster which loading settings replaces
+ */
+static void boot_step_done(void)
+{
+#ifdef CONFIG_APP_BROADCAST
+	int err;
+#endif
+
+	if (atomic_dec(&boot_pending) != 1) {
+		return;
+	}
+
+#ifdef CONFIG_APP_GATT_SERVER
+	k_work_submit(&server_advertise_work);
+#endif
+
+#ifdef CONFIG_APP_BROADCAST
+	err = broadcast_start();
+
+	if (err) {
+		LOG_ERR("Broadcast failed to start (err %d)", err);
+	}
+#endif
+
+	bluetooth_ready = true;
+	k_sem_give(&next_action_sem);
+}
+
+/* Runs on the system workqueue once the controller is ready */
+static void bt_ready(int err)
+{
+	if (err) {
+		LOG_ERR("Bluetooth init failed (err %d)", err);
+		disabled = true;
+		return;
+	}
+
+	LOG_ERR("Bluetooth initialized");
+	boot_step_done();
+}
+
+int main(void)
+{
+	int err;
+
+	if (!pwm_is_ready_dt(&fan_pwm)) {
+		LOG_ERR("PWM init failed");
+	} else {
+		/* Disable PWM and use as GPIO */
+		err = pwm_set_dt(&fan_pwm, PWM_MAX_PERIOD, 0);
+
+		err = pm_device_action_run(fan_pwm.dev, PM_DEVICE_ACTION_SUSPEND);
+
+		if (!err) {
+			pwm_enabled = false;
+		}
+
+		err = gpio_pin_configure_dt(&fan_pin, GPIO_OUTPUT_INACTIVE);
+
+	}
+
+#ifdef CONFIG_APP_TELEMETRY
+	if (!device_is_ready(telemetry_uart)) {
+		LOG_ERR("Telemetry UART is not ready");
+	} else {
+		uart_irq_callback_set(telemetry_uart, telemetry_isr);
+		uart_irq_rx_enable(telemetry_uart);
+	}
+#endif
+
+	k_work_queue_start(&bt_work_q, bt_work_stack, K_THREAD_STACK_SIZEOF(bt_work_stack),
+			   BT_WORK_PRIORITY, NULL);
+
+#ifdef CONFIG_APP_GATT_SERVER
+	k_work_init(&server_notify_work, server_notify);
+	k_work_init(&server_advertise_work, server_advertise);
+#endif
+
+#ifdef CONFIG_APP_BROADCAST
+	k_work_init(&broadcast_work, broadcast_update);
+#endif
+
+#ifdef CONFIG_APP_HISTORY
+	err = history_init();
+
+	if (err) {
+		LOG_ERR("History init failed (err %d)", err);
+	}
+#endif
+
+	/* Consumers are started first so that readings are processed even without Bluetooth */
+	pipeline_thread_id = k_thread_create(&pipeline_thread, pipeline_thread_stack,
+					     K_THREAD_STACK_SIZEOF(pipeline_thread_stack),
+					     pipeline_function, NULL, NULL, NULL,
+					     PIPELINE_THREAD_PRIORITY, 0, K_NO_WAIT);
+
+#ifdef CONFIG_THREAD_NAME
+	k_thread_name_set(pipeline_thread_id, "pipeline");
+	k_thread_name_set(&bt_work_q.thread, "bt_work");
+#endif
+
+	if (!device_is_ready(dht22)) {
+		LOG_ERR("Sensor init failed");
+	} else {
+		/* Read 3 sets of readings due to sensor being of incredibly shit quality and
+		 * giving many bogus readings, in the background whilst the rest starts up
+		 */
+		k_work_init_delayable(&local_warmup_work, local_warmup);
+		(void)k_work_schedule(&local_warmup_work, K_NO_WAIT);
+	}
+
+	k_sem_init(&next_action_sem, 1, 1);
+	k_work_init(&subscribe_workqueue, subscribe_work);
+#ifdef CONFIG_APP_EATT
+	k_work_init_delayable(&eatt_wait_work, eatt_wait);
+#endif
+#ifdef CONFIG_APP_STATE_WATCHDOG
+	k_work_init_delayable(&state_watchdog, state_watchdog_expired);
+#endif
+#ifdef CONFIG_APP_POLLING
+	k_work_init_delayable(&poll_deadline, state_watchdog_expired);
+#endif
+#ifdef CONFIG_APP_TX_POWER
+	k_work_init_delayable(&tx_power_work, tx_power_update);
+#endif
+
+#ifdef CONFIG_APP_SCAN
+	k_work_init_delayable(&scan_stop_work, scan_stop);
+#endif
+
+	/* The controller is brought up in the background whilst the roster is loaded */
+	err = bt_enable(bt_ready);
+
+	if (err) {
+		LOG_ERR("Bluetooth init failed (err %d)", err);
+		disabled = true;
+	}
+
+#ifdef CONFIG_APP_ROSTER_SETTINGS
+	err = settings_subsys_init();
+
+	if (err) {
+		LOG_ERR("Settings init failed (err %d)", err);
+	} else {
+		(void)settings_load_subtree("app");
+	}
+#endif
+
+/* */
+	current_index = 0;
+
+	while (current_index < device_count) {
+		devices[current_index].state = STATE_IDLE;
+		devices[current_index].handles.status = 0;
+		memset(&devices[current_index].handles, 0, sizeof(struct device_handles));
+		++current_index;
+	}
+
+	current_index = 0;
+
+#ifndef CONFIG_APP_START_BOOTUP
+	disabled = true;
+#endif
+
+	/* The roster is final, Bluetooth may still be coming up */
+	boot_step_done();
+
+	/* Setup threads, the sensor thread starts connecting once Bluetooth is ready */
+	sensor_thread_id = k_thread_create(&sensor_thread, sensor_thread_stack,
+					   K_THREAD_STACK_SIZEOF(sensor_thread_stack),
+					   sensor_function, NULL, NULL, NULL,
+					   SENSOR_THREAD_PRIORITY, 0, K_NO_WAIT);
+
+	fan_thread_id = k_thread_create(&fan_thread, fan_thread_stack,
+					K_THREAD_STACK_SIZEOF(fan_thread_stack),
+					fan_function, NULL, NULL, NULL,
+					FAN_THREAD_PRIORITY, 0, K_NO_WAIT);
+
+#ifdef CONFIG_THREAD_NAME
+	k_thread_name_set(sensor_thread_id, "sensor");
+	k_thread_name_set(fan_thread_id, "fan");
+#endif
+
+	return 0;
+}
+
+#if defined(CONFIG_APP_OUTPUT_FORMAT_CUSTOM)
+/* Outputs ESS readings in the following format:
+ * Start delimiter: ##
+ * { for each device with data:
+ *     Index number: e.g. 0
+ *     Timestamp (if enabled): e.g. 1700000000000
+ *     Temperature reading: e.g. 25.12
+ *     Pressure reading: e.g. 1000270
+ *     Humidity reading: e.g. 52.04
+ *     Dew point reading: e.g. 8
+ * }
+ * End delimiter: ^^
+ *
+ * Each value has a comma (,) separator.
+ */
+static int ess_readings_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	uint8_t i = 0;
+	char line[OUTPUT_LINE_SIZE];
+	size_t length;
+	bool first = true;
+	struct output_row row;
+	int64_t max_age = (int64_t)CONFIG_APP_READINGS_MAX_AGE * MSEC_PER_SEC;
+
+	if (argc == 2) {
+		max_age = (int64_t)strtoul(argv[1], NULL, 0) * MSEC_PER_SEC;
+	}
+
+	/* Rows are output one at a time, so any number of devices fit */
+	shell_fprintf(sh, SHELL_NORMAL, "##");
+
+	while (i < device_count) {
+		if (device_reporting(i) && output_row_get(i, max_age, &row) &&
+		    (max_age != 0 || row.oldest > shell_readings_output[i])) {
+			length = output_row_line(&row, line, sizeof(line));
+
+			/* Rows are comma separated, without a trailing comma */
+			if (length > 0) {
+				line[(length - 1)] = 0;
+			}
+
+			shell_fprintf(sh, SHELL_NORMAL, "%s%s", (first ? "" : ","), line);
+			shell_readings_output[i] = k_uptime_get();
+			first = false;
+		}
+
+		++i;
+	}
+
+/* Should do sht22 here */
+
+	shell_print(sh, "^^");
+
+	return 0;
+}
+#elif defined(CONFIG_APP_OUTPUT_FORMAT_CSV)
+/* Outputs ESS readings in CSV format, with headings */
+static int ess_readings_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	uint8_t i = 0;
+	char line[OUTPUT_LINE_SIZE];
+	int err;
+	struct device_readings readings;
+	struct output_row row;
+	int64_t max_age = (int64_t)CONFIG_APP_READINGS_MAX_AGE * MSEC_PER_SEC;
+
+	if (argc == 2) {
+		max_age = (int64_t)strtoul(argv[1], NULL, 0) * MSEC_PER_SEC;
+	}
+
+	shell_fprintf(sh, SHELL_NORMAL, "device,"
+#if defined(CONFIG_APP_OUTPUT_DEVICE_ADDRESS)
+		"address,"
+#endif
+#if defined(CONFIG_APP_OUTPUT_DEVICE_NAME)
+		"name,"
+#endif
+#if defined(CONFIG_APP_OUTPUT_TIMESTAMP)
+		"time,"
+#endif
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+		"temperature,"
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+		"humidity,"
+#endif
+#ifdef CONFIG_APP_ESS_PRESSURE
+		"pressure,"
+#endif
+#ifdef CONFIG_APP_ESS_DEW_POINT
+		"dewpoint,"
+#endif
+#ifdef CONFIG_APP_BATTERY_LEVEL
+		"battery,"
+#endif
+		"\n");
+
+	/* Read rubbish connected sensor */
+	err = local_sample();
+
+	/* Rows are output one at a time, so any number of devices fit */
+	while (i < device_count) {
+		if (device_reporting(i) && output_row_get(i, max_age, &row) &&
+		    (max_age != 0 || row.oldest > shell_readings_output[i])) {
+			(void)output_row_line(&row, line, sizeof(line));
+			shell_fprintf(sh, SHELL_NORMAL, "%s", line);
+			shell_readings_output[i] = k_uptime_get();
+		}
+
+		++i;
+	}
+
+	if (err) {
+		/* Wait a short period of time and try again */
+		k_sleep(K_MSEC(300));
+		err = local_sample();
+	}
+
+	if (!err) {
+		(void)snapshot_read(&local_snapshot, &readings);
+
+		snprintf(line, sizeof(line), "%d,"
+#if defined(CONFIG_APP_OUTPUT_DEVICE_ADDRESS)
+			"LOCAL,"
+#endif
+#if defined(CONFIG_APP_OUTPUT_DEVICE_NAME)
+			"Loft,"
+#endif
+#if defined(CONFIG_APP_OUTPUT_TIMESTAMP)
+			"%lld,"
+#endif
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+			"%.2f,"
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+			"%.2f,"
+#endif
+#ifdef CONFIG_APP_ESS_PRESSURE
+			"0,"
+#endif
+#ifdef CONFIG_APP_ESS_DEW_POINT
+			"%d,"
+#endif
+#ifdef CONFIG_APP_BATTERY_LEVEL
+			"0,"
+#endif
+			"\n", (device_id_value_offset + i)
+#if defined(CONFIG_APP_OUTPUT_TIMESTAMP)
+			, output_time(readings_oldest(&readings))
+#endif
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+			, readings.temperature
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+			, readings.humidity
+#endif
+#ifdef CONFIG_APP_ESS_DEW_POINT
+			, readings.dew_point
+#endif
+			);
+		shell_fprintf(sh, SHELL_NORMAL, "%s", line);
+	}
+
+	shell_fprintf(sh, SHELL_NORMAL, "\n\n");
+
+	return 0;
+}
+#else
+#error "Invalid output format selected"
+#endif
+
+static int ess_disconnect_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	uint8_t i = 0;
+
+	while (i < device_count) {
+		if (devices[i].state != STATE_IDLE && devices[i].connection != NULL) {
+			int32_t err = bt_conn_disconnect(devices[i].connection, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+
+			if (err != 0) {
+				shell_error(sh, "Error whilst disconnecting from #%d: %d", i, err);
+			}
+		}
+
+		++i;
+	}
+
+	shell_print(sh, "Disconnected from all devices");
+
+	return 0;
+}
+
+static int ess_disable_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	if (!disabled) {
+		uint8_t i = 0;
+		disabled = true;
+
+		while (i < device_count) {
+			if (devices[i].state != STATE_IDLE && devices[i].connection != NULL) {
+				int32_t err = bt_conn_disconnect(devices[i].connection, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+
+				if (err != 0) {
+					shell_error(sh, "Error whilst disconnecting from #%d: %d", i, err);
+				}
+			}
+
+			++i;
+		}
+
+		shell_print(sh, "Application state changed to disabled.");
+
+		return 0;
+	}
+
+	shell_error(sh, "Application is already disabled.");
+
+	return -EPERM;
+}
+
+static int ess_enable_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	if (disabled) {
+		disabled = false;
+		shell_print(sh, "Application state changed to enabled.");
+		k_sem_give(&next_action_sem);
+		return 0;
+	}
+
+	shell_error(sh, "Application is already enabled.");
+
+	return -EPERM;
+}
+
+static char *state_to_text(uint8_t state)
+{
+	if (state == STATE_IDLE) {
+		return "Idle";
+	} else if (state == STATE_CONNECTING) {
+		return "Connecting";
+	} else if (state == STATE_CONNECTED) {
+		return "Connected";
+	} else if (state == STATE_DISCOVERING) {
+		return "Discovering";
+	} else if (state == STATE_ACTIVE) {
+		return "Active";
+	}
+
+	return "Unknown";
+}
+
+#ifdef CONFIG_APP_TX_POWER
+#define STATUS_LINK_HEADER " RSSI | TX  |"
+#define STATUS_LINK_RULE "------|-----|"
+#define STATUS_LINK_NONE "      |     |"
+#define STATUS_LINK_SIZE sizeof(STATUS_LINK_NONE)
+
+/* Formats the RSSI and TX power columns of a device for "ess status" */
+static void status_link(uint8_t index, char *buffer)
+{
+	if (devices[index].connection == NULL || devices[index].rssi == RSSI_UNKNOWN) {
+		strcpy(buffer, STATUS_LINK_NONE);
+	} else {
+		snprintf(buffer, STATUS_LINK_SIZE, " %4d | %3d |", devices[index].rssi,
+			 devices[index].tx_power);
+	}
+}
+#else
+#define STATUS_LINK_HEADER ""
+#define STATUS_LINK_RULE ""
+#define STATUS_LINK_NONE ""
+#define STATUS_LINK_SIZE 1
+#define status_link(index, buffer) (buffer)[0] = 0
+#endif
+
+static int ess_status_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	uint8_t i = 0;
+	uint8_t largest_name = 0;
+	int8_t repeat_size;
+
+	while (i < device_count) {
+		uint8_t string_size;
+
+		string_size = (uint8_t)strlen(devices[i].name);
+
+		if (string_size > largest_name) {
+			largest_name = string_size;
+		}
+
+		++i;
+	}
+
+
+	repeat_size = (int8_t)largest_name - 4;
+	if (repeat_size < 0) {
+		repeat_size = 0;
+	}
+
+	shell_print(sh, "# | Address        | Name%.*s | State       |%s Readings", repeat_size,
+		    "                  ", STATUS_LINK_HEADER);
+	shell_print(sh, "--|----------------|-----%.*s-|-------------|%s---------", repeat_size,
+		    "------------------", STATUS_LINK_RULE);
+
+	i = 0;
+
+	while (i < device_count) {
+		char *state = state_to_text(devices[i].state);
+		struct device_readings readings;
+		char link[STATUS_LINK_SIZE];
+
+		(void)readings_get(i, &readings);
+		status_link(i, link);
+
+		shell_print(sh, "%d | %02x%02x%02x%02x%02x%02x%02x | %s%.*s | %s%.*s |%s 0x%x %s",
+			    (device_id_value_offset + i),
+			    devices[i].address.type, devices[i].address.a.val[5],
+			    devices[i].address.a.val[4], devices[i].address.a.val[3],
+			    devices[i].address.a.val[2], devices[i].address.a.val[1],
+			    devices[i].address.a.val[0], devices[i].name,
+			    (largest_name - strlen(devices[i].name)), "                  ",
+			    state, (11 - strlen(state)), "                  ", link,
+			    readings.received,
+			    (readings.received == RECEIVED_ALL ? tick_character : ""));
+		++i;
+	}
+
+	if (device_is_ready(dht22) && last_dht_reading_pass == true) {
+		shell_print(sh, "%d | LOCAL          | Loft%.*s | Active      |%s 0x%x %s", (device_id_value_offset + i),
+			    (largest_name - 4), "                  ", STATUS_LINK_NONE, (0
+#ifdef CONFIG_APP_ESS_TEMPERATURE
+			    + RECEIVED_TEMPERATURE
+#endif
+#ifdef CONFIG_APP_ESS_HUMIDITY
+			    + RECEIVED_HUMIDITY
+#endif
+			    ), tick_character);
+	} else {
+		shell_print(sh, "%d | LOCAL          | Loft%.*s | Error       |%s 0x0", (device_id_value_offset + i),
+			    (largest_name - 4), "                  ", STATUS_LINK_NONE);
+	}
+
+	return 0;
+}
+
+static int ess_stats_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	uint8_t i = 0;
+
+#ifdef CONFIG_APP_TX_POWER
+	shell_print(sh, "# | Connections | Failures | Disconnects | Timeouts | Link lost | RSSI avg | RSSI min");
+	shell_print(sh, "--|-------------|----------|-------------|----------|-----------|----------|---------");
+#else
+	shell_print(sh, "# | Connections | Failures | Disconnects | Timeouts | Link lost");
+	shell_print(sh, "--|-------------|----------|-------------|----------|----------");
+#endif
+
+	while (i < device_count) {
+#ifdef CONFIG_APP_TX_POWER
+		if (devices[i].stats.rssi_samples > 0) {
+			shell_print(sh, "%d | %11u | %8u | %11u | %8u | %9u | %8d | %8d",
+				    (device_id_value_offset + i), devices[i].stats.connections,
+				    devices[i].stats.failures, devices[i].stats.disconnects,
+				    devices[i].stats.timeouts, devices[i].stats.link_losses,
+				    (int)(devices[i].stats.rssi_total /
+					  (int32_t)devices[i].stats.rssi_samples),
+				    devices[i].stats.rssi_min);
+		} else {
+			/* No samples yet, placeholders keep the columns lined up */
+			shell_print(sh, "%d | %11u | %8u | %11u | %8u | %9u | %8s | %8s",
+				    (device_id_value_offset + i), devices[i].stats.connections,
+				    devices[i].stats.failures, devices[i].stats.disconnects,
+				    devices[i].stats.timeouts, devices[i].stats.link_losses, "-", "-");
+		}
+#else
+		shell_print(sh, "%d | %11u | %8u | %11u | %8u | %9u", (device_id_value_offset + i),
+			    devices[i].stats.connections, devices[i].stats.failures,
+			    devices[i].stats.disconnects, devices[i].stats.timeouts,
+			    devices[i].stats.link_losses);
+#endif
+		++i;
+	}
+
+	shell_print(sh, "Readings dropped by pipeline: %ld", (long)atomic_get(&pipeline_dropped));
+
+	return 0;
+}
+
+#ifdef CONFIG_APP_AGGREGATES
+/* Outputs the statistics of the last completed window of each reading as CSV, window end
+ * times are in the same format as reading timestamps
+ */
+static int ess_aggregate_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	uint8_t first = 0;
+	uint8_t last = (AGGREGATE_WINDOWS - 1);
+	uint8_t i = 0;
+
+	if (argc == 2) {
+		uint32_t window = strtoul(argv[1], NULL, 0);
+
+		if (window < 1 || window > AGGREGATE_WINDOWS) {
+			shell_error(sh, "Invalid window, must be between 1-%d", AGGREGATE_WINDOWS);
+			return -EINVAL;
+		}
+
+		first = (uint8_t)(window - 1);
+		last = first;
+	}
+
+	shell_print(sh, "device,field,window,end,count,min,max,mean,stddev");
+
+	while (i <= device_count) {
+		/* Local sensor is output after the devices */
+		uint8_t index = (i == device_count ? DEVICE_SLOTS : i);
+		uint8_t bit = 0;
+
+		while (bit < READING_FIELDS) {
+			uint8_t number = first;
+
+			while ((RECEIVED_ALL & BIT(bit)) && number <= last) {
+				struct aggregate_result result;
+
+				aggregate_get(index, bit, number, &result);
+
+				if (result.count > 0) {
+					shell_print(sh, "%d,%s,%u,%lld,%u,%.2f,%.2f,%.2f,%.2f",
+						    (device_id_value_offset + i), field_names[bit],
+						    aggregate_windows[number], output_time(result.end),
+						    result.count, (double)result.min, (double)result.max,
+						    (double)result.mean, (double)result.stddev);
+				}
+
+				++number;
+			}
+
+			++bit;
+		}
+
+		++i;
+	}
+
+	return 0;
+}
+#endif
+
+static int ess_roster_add_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	bt_addr_le_t address;
+	int err;
+
+	if (address_parse(argv[1], &address) != 0) {
+		shell_error(sh, "Invalid address, expected type and address e.g. 01f7b21c7b0722");
+		return -EINVAL;
+	}
+
+	err = roster_add(&address, (argc == 3 ? argv[2] : NULL));
+
+	if (err == -ENOMEM) {
+		shell_error(sh, "Roster is full, it holds %d devices", ROSTER_DEVICES_MAX);
+		return err;
+	} else if (err < 0) {
+		shell_error(sh, "Failed to add device: %d", err);
+		return err;
+	}
+
+	shell_print(sh, "Added as #%d", (device_id_value_offset + err));
+
+	return 0;
+}
+
+static int ess_roster_remove_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	uint32_t index = strtoul(argv[1], NULL, 0);
+	int err;
+
+	if (index < device_id_value_offset) {
+		shell_error(sh, "Invalid device");
+		return -EINVAL;
+	}
+
+	err = roster_remove((uint8_t)(index - device_id_value_offset));
+
+	if (err == -EBUSY) {
+		shell_error(sh, "Application must be disabled and every device disconnected "
+			    "before removing devices");
+	} else if (err) {
+		shell_error(sh, "Failed to remove device: %d", err);
+	} else {
+		shell_print(sh, "Device removed");
+	}
+
+	return err;
+}
+
+#ifdef CONFIG_APP_SCAN
+static int ess_scan_start_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	struct bt_le_scan_param param = {
+		.type = BT_LE_SCAN_TYPE_PASSIVE,
+		.options = BT_LE_SCAN_OPT_NONE,
+		.interval = BT_GAP_SCAN_FAST_INTERVAL,
+		.window = BT_GAP_SCAN_FAST_INTERVAL,
+	};
+	uint32_t duration = CONFIG_APP_SCAN_DURATION;
+	int err;
+
+	if (argc == 2) {
+		duration = strtoul(argv[1], NULL, 0);
+	}
+
+	if (scanning) {
+		shell_error(sh, "Scan already in progress");
+		return -EALREADY;
+	}
+
+	scanning = true;
+
+	if (busy) {
+		scanning = false;
+		shell_error(sh, "Busy connecting to a device, try again shortly");
+		return -EBUSY;
+	}
+
+	scan_result_count = 0;
+	scan_duration = duration;
+	err = bt_le_scan_start(&param, scan_received);
+
+	if (err) {
+		scanning = false;
+		k_sem_give(&next_action_sem);
+		shell_error(sh, "Scan start failed: %d", err);
+		return err;
+	}
+
+	k_work_schedule(&scan_stop_work, K_SECONDS(duration));
+	shell_print(sh, "Scanning for %u seconds", duration);
+
+	return 0;
+}
+
+static int ess_scan_stop_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	if (!scanning) {
+		shell_error(sh, "No scan in progress");
+		return -EPERM;
+	}
+
+	k_work_reschedule(&scan_stop_work, K_NO_WAIT);
+	shell_print(sh, "Scan stopped");
+
+	return 0;
+}
+
+static int ess_scan_list_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	uint8_t i = 0;
+
+	if (scanning) {
+		shell_error(sh, "Scan in progress");
+		return -EBUSY;
+	}
+
+	shell_print(sh, "# | Address        | Name               | RSSI | Adverts/s | Roster");
+	shell_print(sh, "--|----------------|--------------------|------|-----------|-------");
+
+	while (i < scan_result_count) {
+		const struct scan_result *result = &scan_results[i];
+		uint32_t rate = (scan_duration > 0 ? (result->adverts * 10U / scan_duration) : 0);
+		uint8_t l = 0;
+
+		while (l < device_count) {
+			if (bt_addr_le_cmp(&devices[l].address, &result->address) == 0) {
+				break;
+			}
+
+			++l;
+		}
+
+		shell_print(sh, "%d | %02x%02x%02x%02x%02x%02x%02x | %-18s | %4d | %7u.%u | %s",
+			    (i + 1), result->address.type, result->address.a.val[5],
+			    result->address.a.val[4], result->address.a.val[3],
+			    result->address.a.val[2], result->address.a.val[1],
+			    result->address.a.val[0], result->name, scan_average_rssi(result),
+			    (rate / 10U), (rate % 10U), (l < device_count ? tick_character : ""));
+		++i;
+	}
+
+	return 0;
+}
+
+static int ess_scan_adopt_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	uint32_t rank = strtoul(argv[1], NULL, 0);
+	int err;
+
+	if (scanning) {
+		shell_error(sh, "Scan in progress");
+		return -EBUSY;
+	}
+
+	if (rank < 1 || rank > scan_result_count) {
+		shell_error(sh, "Invalid scan result");
+		return -EINVAL;
+	}
+
+	err = roster_add(&scan_results[rank - 1].address,
+			 (argc == 3 ? argv[2] : scan_results[rank - 1].name));
+
+	if (err == -ENOMEM) {
+		shell_error(sh, "Roster is full, it holds %d devices", ROSTER_DEVICES_MAX);
+		return err;
+	} else if (err < 0) {
+		shell_error(sh, "Failed to adopt device: %d", err);
+		return err;
+	}
+
+	shell_print(sh, "Adopted as #%d", (device_id_value_offset + err));
+
+	return 0;
+}
+#endif
+
+/* Reads the fan request set from the shell, which is held back while an alarm forces the fan */
+static void fan_request_get(struct fan_request *request)
+{
+#ifdef CONFIG_APP_ALARMS
+	k_mutex_lock(&alarm_lock, K_FOREVER);
+
+	if (alarm_fan_forced) {
+		memcpy(request, &alarm_fan_saved, sizeof(struct fan_request));
+		k_mutex_unlock(&alarm_lock);
+		return;
+	}
+
+	k_mutex_unlock(&alarm_lock);
+#endif
+
+	(void)zbus_chan_read(&fan_chan, request, K_FOREVER);
+}
+
+/* Publishes a fan request from the shell. Whilst an alarm forces the fan, the request replaces
+ * the one put back once the last alarm clears and 1 is returned
+ */
+static int fan_request_set(const struct fan_request *request)
+{
+#ifdef CONFIG_APP_ALARMS
+	k_mutex_lock(&alarm_lock, K_FOREVER);
+
+	if (alarm_fan_forced) {
+		memcpy(&alarm_fan_saved, request, sizeof(struct fan_request));
+		k_mutex_unlock(&alarm_lock);
+		return 1;
+	}
+
+	k_mutex_unlock(&alarm_lock);
+#endif
+
+	if (zbus_chan_pub(&fan_chan, request, K_MSEC(100)) != 0) {
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+static int fan_speed_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	struct fan_request request;
+	int err;
+
+	if (argc == 1) {
+		fan_request_get(&request);
+
+		if (request.half == true) {
+			shell_print(sh, "Fan speed: %u (half)", request.speed);
+		} else {
+			shell_print(sh, "Fan speed: %u", request.speed);
+		}
+	} else if (strcmp(argv[1], "actual") == 0) {
+		if (current_half_fan_speed == true) {
+			shell_print(sh, "Actual fan speed: %u (half)", current_fan_speed);
+		} else {
+			shell_print(sh, "Actual fan speed: %u", current_fan_speed);
+		}
+	} else {
+		uint32_t speed = strtoul(argv[1], NULL, 0);
+
+		if (speed > FAN_SPEED_MAX) {
+			shell_print(sh, "Invalid speed, must be between 0-100");
+		} else {
+			fan_request_get(&request);
+
+			if (argc == 3) {
+				if (strcmp(argv[2], "half") == 0) {
+					request.half = true;
+				} else {
+					shell_error(sh, "Invalid option");
+					return -EINVAL;
+				}
+			} else {
+				request.half = false;
+			}
+
+			request.speed = (uint8_t)speed;
+			err = fan_request_set(&request);
+
+			if (err < 0) {
+				shell_error(sh, "Fan is busy");
+				return err;
+			} else if (err > 0) {
+				shell_print(sh, "Fan speed set, applied once alarms clear");
+			} else {
+				shell_print(sh, "Fan speed set");
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int fan_ramp_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	struct fan_request request;
+	uint32_t rate;
+	uint8_t i = 0;
+	int err;
+
+	fan_request_get(&request);
+
+	if (argc == 1) {
+		shell_print(sh, "Fan ramp: %u%%/s, %s", request.slew_rate,
+			    fan_curve_names[request.curve]);
+		return 0;
+	}
+
+	rate = strtoul(argv[1], NULL, 0);
+
+	if (rate > FAN_SPEED_MAX) {
+		shell_error(sh, "Invalid rate, must be between 0-100");
+		return -EINVAL;
+	}
+
+	request.slew_rate = (uint8_t)rate;
+
+	if (argc == 3) {
+		while (i < FAN_CURVE_COUNT) {
+			if (strcmp(argv[2], fan_curve_names[i]) == 0) {
+				break;
+			}
+
+			++i;
+		}
+
+		if (i == FAN_CURVE_COUNT) {
+			shell_error(sh, "Invalid curve, must be linear, scurve or soft");
+			return -EINVAL;
+		}
+
+		request.curve = (enum fan_curve)i;
+	}
+
+	/* Also retargets a ramp in progress so that the new rate applies straight away */
+	err = fan_request_set(&request);
+
+	if (err < 0) {
+		shell_error(sh, "Fan is busy");
+		return err;
+	} else if (err > 0) {
+		shell_print(sh, "Fan ramp set, applied once alarms clear");
+	} else {
+		shell_print(sh, "Fan ramp set");
+	}
+
+	return 0;
+}
 
-		err = bt_gatt_subscribe(conn, param);
+static int app_reboot_handler(const struct shell *sh, size_t argc, char **argv)
+{
+        sys_reboot(SYS_REBOOT_COLD);
 
-		if (err && err != -EALREADY) {
-			LOG_ERR("Subscribe failed (err %d)", err);
-		} else {
-			LOG_ERR("[SUBSCRIBED]");
-		}
-	}
+	return 0;
+}
 
-	if (action == 0 || action == 1 || action == 2) {
-		discover_params.uuid = &uuid.uuid;
-		err = bt_gatt_discover(conn, &discover_params);
+static int app_bootloader_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	int err;
 
-		if (err) {
-			LOG_ERR("Discover failed (err %d)", err);
+	if (!gpio_is_ready_dt(&reset)) {
+		shell_print(sh, "GPIO is not ready");
+	} else {
+		err = gpio_pin_configure_dt(&reset, GPIO_OUTPUT_ACTIVE);
+
+		if (err < 0) {
+			shell_print(sh, "GPIO set failed");
 		}
 	}
+
+	return 0;
 }
 
-static void subscribe_work(struct k_work *work)
+static int app_version_handler(const struct shell *sh, size_t argc, char **argv)
 {
-	next_action(devices[current_index].connection, NULL);
+	shell_print(sh, "Version: %s", APP_VERSION_TWEAK_STRING);
+
+	return 0;
 }
 
-static uint8_t discover_func(struct bt_conn *conn, const struct bt_gatt_attr *attr,
-			     struct bt_gatt_discover_params *params)
+/* Shows how long after boot each device first had a complete set of readings */
+static int app_boot_handler(const struct shell *sh, size_t argc, char **argv)
 {
-	int err = 0;
+	uint8_t i = 0;
 
-	if (!attr) {
-		LOG_ERR("Discover complete");
-		(void)memset(params, 0, sizeof(*params));
-		return BT_GATT_ITER_STOP;
-	}
+	shell_print(sh, "# | First reading (ms)");
+	shell_print(sh, "--|-------------------");
 
-	LOG_ERR("[ATTRIBUTE] handle %u", attr->handle);
+	while (i < device_count) {
+		if (devices[i].stats.first_reading != 0) {
+			shell_print(sh, "%d | %lld", (device_id_value_offset + i),
+				    devices[i].stats.first_reading);
+		} else {
+			shell_print(sh, "%d | -", (device_id_value_offset + i));
+		}
 
-	if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_ESS)) {
-		devices[current_index].state = STATE_DISCOVERING;
-		devices[current_index].handles.service = attr->handle;
-#ifdef CONFIG_APP_ESS_TEMPERATURE
-	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_TEMPERATURE)) {
-		devices[current_index].handles.temperature.value_handle =
-								bt_gatt_attr_value_handle(attr);
-	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_GATT_CCC) &&
-		   devices[current_index].handles.status == FIND_TEMPERATURE_CCC) {
-		devices[current_index].handles.temperature.ccc_handle = attr->handle;
-#endif
-#ifdef CONFIG_APP_ESS_HUMIDITY
-	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_HUMIDITY)) {
-		devices[current_index].handles.humidity.value_handle =
-								bt_gatt_attr_value_handle(attr);
-	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_GATT_CCC) &&
-		   devices[current_index].handles.status == FIND_HUMIDITY_CCC) {
-		devices[current_index].handles.humidity.ccc_handle = attr->handle;
-#endif
-#ifdef CONFIG_APP_ESS_PRESSURE
-	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_PRESSURE)) {
-		devices[current_index].handles.pressure.value_handle =
-								bt_gatt_attr_value_handle(attr);
-	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_GATT_CCC) &&
-		   devices[current_index].handles.status == FIND_PRESSURE_CCC) {
-		devices[current_index].handles.pressure.ccc_handle = attr->handle;
-#endif
-#ifdef CONFIG_APP_ESS_DEW_POINT
-	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_DEW_POINT)) {
-		devices[current_index].handles.dew_point.value_handle =
-								bt_gatt_attr_value_handle(attr);
-	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_GATT_CCC) &&
-		   devices[current_index].handles.status == FIND_DEW_POINT_CCC) {
-		devices[current_index].handles.dew_point.ccc_handle = attr->handle;
-#endif
-#ifdef CONFIG_APP_BATTERY_LEVEL
-	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_BAS)) {
-		devices[current_index].handles.battery_service = attr->handle;
-	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_BAS_BATTERY_LEVEL)) {
-		devices[current_index].handles.battery_level.value_handle =
-								bt_gatt_attr_value_handle(attr);
-	} else if (!bt_uuid_cmp(discover_params.uuid, BT_UUID_GATT_CCC) &&
-		   devices[current_index].handles.status == FIND_BATTERY_LEVEL_CCC) {
-		devices[current_index].handles.battery_level.ccc_handle = attr->handle;
-#endif
+		++i;
 	}
 
-	if (err) {
-		err = bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	if (local_first_reading != 0) {
+		shell_print(sh, "%d | %lld (local)", (device_id_value_offset + i), local_first_reading);
 	} else {
-		next_action(conn, attr);
+		shell_print(sh, "%d | - (local)", (device_id_value_offset + i));
 	}
 
-	return BT_GATT_ITER_STOP;
+	return 0;
 }
 
-static void connected(struct bt_conn *conn, uint8_t conn_err)
+static int app_time_handler(const struct shell *sh, size_t argc, char **argv)
 {
-	char addr[BT_ADDR_LE_STR_LEN];
-	int err;
+	if (argc == 2) {
+		int64_t epoch = (int64_t)strtoull(argv[1], NULL, 0);
+
+		epoch_offset = epoch - k_uptime_get();
+		time_synced = true;
+		shell_print(sh, "Time set");
+	} else if (time_synced) {
+		shell_print(sh, "Time: %lld", (k_uptime_get() + epoch_offset));
+	} else {
+		shell_print(sh, "Time: not set (uptime %lld)", k_uptime_get());
+	}
 
-	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+	return 0;
+}
 
-	if (conn_err) {
-		LOG_ERR("Failed to connect to %s (%u)", addr, conn_err);
+#ifdef CONFIG_APP_TELEMETRY
+static int app_telemetry_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	shell_print(sh, "Queued: %u, free: %u, dropped: %u", ring_buf_size_get(&telemetry_ring),
+		    ring_buf_space_get(&telemetry_ring), telemetry_dropped);
 
-		/* Mark as not busy and advance state machine */
-		bt_conn_unref(conn);
-		devices[current_index].state = STATE_IDLE;
-		busy = false;
+	return 0;
+}
+#endif
 
-		if (connection_failures < 30) {
-			++connection_failures;
-		}
+#ifdef CONFIG_APP_STACK_REPORT
+#define STACK_REPORT_THREADS 16
 
-		++current_index;
+struct stack_report {
+	char name[CONFIG_THREAD_MAX_NAME_LEN];
+	size_t size;
+	size_t used;
+};
 
-		if (current_index >= DEVICE_COUNT) {
-			current_index = 0;
-		}
+static struct stack_report stack_reports[STACK_REPORT_THREADS];
+static uint8_t stack_report_count;
 
-		k_sem_give(&next_action_sem);
+/* Runs with the thread list locked, so results are only copied and printed afterwards */
+static void app_stacks_callback(struct thread_analyzer_info *info)
+{
+	struct stack_report *report;
 
+	if (stack_report_count >= STACK_REPORT_THREADS) {
 		return;
 	}
 
-	connection_failures = 0;
+	report = &stack_reports[stack_report_count];
+	strncpy(report->name, info->name, (sizeof(report->name) - 1));
+	report->name[sizeof(report->name) - 1] = '\0';
+	report->size = info->stack_size;
+	report->used = info->stack_used;
+	++stack_report_count;
+}
 
-	devices[current_index].state = STATE_CONNECTED;
-	memset(&devices[current_index].handles, 0, sizeof(struct device_handles));
+static int app_stacks_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	uint8_t i = 0;
 
-	LOG_ERR("Connected: %s", addr);
+	stack_report_count = 0;
+	thread_analyzer_run(app_stacks_callback, 0);
 
-	memcpy(&uuid, BT_UUID_ESS, sizeof(uuid));
-	devices[current_index].handles.status = FIND_ESS_SERVICE;
+	shell_print(sh, "Thread           | Size  | Used  | Use");
+	shell_print(sh, "-----------------|-------|-------|-----");
 
-	discover_params.uuid = &uuid.uuid;
-	discover_params.func = discover_func;
-	discover_params.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
-	discover_params.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
-	discover_params.type = BT_GATT_DISCOVER_PRIMARY;
+	while (i < stack_report_count) {
+		shell_print(sh, "%-16s | %5u | %5u | %3u%%", stack_reports[i].name,
+			    stack_reports[i].size, stack_reports[i].used,
+			    (stack_reports[i].used * 100U / stack_reports[i].size));
+		++i;
+	}
 
-	err = bt_gatt_discover(conn, &discover_params);
+	return 0;
+}
+#endif
 
-	if (err) {
-		LOG_ERR("Discover failed(err %d)", err);
-		err = bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+#ifdef CONFIG_APP_TRACE
+static int ess_trace_start_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	struct trace_header header = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+	};
+	k_spinlock_key_t key = k_spin_lock(&trace_lock);
+
+	memcpy(trace_buffer, &header, sizeof(header));
+	trace_used = sizeof(header);
+	trace_records = 0;
+	trace_dropped = 0;
+	trace_start = k_uptime_get();
+	trace_recording = true;
+	k_spin_unlock(&trace_lock, key);
+
+	shell_print(sh, "Trace recording started");
+
+	return 0;
+}
+
+static int ess_trace_stop_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	k_spinlock_key_t key = k_spin_lock(&trace_lock);
+
+	if (!trace_recording) {
+		k_spin_unlock(&trace_lock, key);
+		shell_error(sh, "Trace is not being recorded");
+		return -EPERM;
 	}
+
+	trace_recording = false;
+	((struct trace_header *)trace_buffer)->records = trace_records;
+	k_spin_unlock(&trace_lock, key);
+
+	shell_print(sh, "Recorded %u notifications in %zu bytes, %u dropped", trace_records,
+		    trace_used, trace_dropped);
+
+	return 0;
 }
 
-static void disconnected(struct bt_conn *conn, uint8_t reason)
+/* Outputs the trace as lines of hex which scripts/notification_trace.py converts back to a
+ * binary trace
+ */
+static int ess_trace_dump_handler(const struct shell *sh, size_t argc, char **argv)
 {
-	uint8_t i = 0;
-	char addr[BT_ADDR_LE_STR_LEN];
-	bool increment = false;
+	char line[65];
+	size_t offset = 0;
 
-	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
+	if (trace_recording) {
+		shell_error(sh, "Trace recording must be stopped first");
+		return -EBUSY;
+	}
 
-	LOG_ERR("Disconnected: %s (reason 0x%02x)", addr, reason);
+	if (trace_used == 0) {
+		shell_error(sh, "No trace has been recorded");
+		return -ENOENT;
+	}
 
-	/* Check if this was the device currently being serviced */
-	if (devices[current_index].connection == conn) {
-		i = current_index;
-		increment = true;
+	while (offset < trace_used) {
+		size_t size = MIN((trace_used - offset), 32);
 
-		if (devices[i].state != STATE_ACTIVE && busy) {
-			/* We are no longer busy, allow state machine to connect to next device */
-			busy = false;
-		}
+		(void)bin2hex(&trace_buffer[offset], size, line, sizeof(line));
+		shell_print(sh, "%s", line);
+		offset += size;
 	}
 
-	/* Search for the instance */
-	while (i < DEVICE_COUNT) {
-		if (devices[i].connection == conn) {
-			if (devices[i].state == STATE_ACTIVE) {
-				/* Reset connection failure count to allow fast reconnection to device */
-				connection_failures = 0;
-			}
+	return 0;
+}
 
-			devices[i].state = STATE_IDLE;
-			devices[i].connection = NULL;
-			devices[i].handles.status = 0;
-			memset(&devices[i].readings, 0, sizeof(struct device_readings));
+/* Gets the upper bound of the latency bucket containing the given percentage of samples */
+static uint32_t trace_percentile(const uint32_t *histogram, uint32_t total, uint8_t percent)
+{
+	uint32_t target = DIV_ROUND_UP(total * percent, 100);
+	uint32_t count = 0;
+	uint8_t i = 0;
+
+	while (i < (TRACE_LATENCY_BUCKETS - 1)) {
+		count += histogram[i];
+
+		if (count >= target) {
 			break;
 		}
 
 		++i;
 	}
 
-	if (increment) {
-		++current_index;
+	return BIT(i);
+}
 
-		if (current_index >= DEVICE_COUNT) {
-			current_index = 0;
-		}
+/* Passes each notification of a trace through the notification processing and output paths,
+ * either as fast as possible or at the recorded times. Latency is the processing time of each
+ * notification, plus how late it was processed when replaying at the recorded times
+ */
+static int trace_replay(const struct shell *sh, const uint8_t *trace, size_t size, bool realtime)
+{
+	struct trace_header header;
+	uint32_t histogram[TRACE_LATENCY_BUCKETS] = {0};
+	uint32_t replayed = 0;
+	uint32_t skipped = 0;
+	uint32_t latency_min = UINT32_MAX;
+	uint32_t latency_max = 0;
+	uint64_t busy_cycles = 0;
+	uint64_t busy_us;
+	size_t offset = sizeof(header);
+	int64_t start;
+	int64_t elapsed;
+	uint8_t i = 0;
+
+	if (size < sizeof(header)) {
+		shell_error(sh, "Invalid trace");
+		return -EINVAL;
 	}
 
-	bt_conn_unref(conn);
-	k_sem_give(&next_action_sem);
-}
+	memcpy(&header, trace, sizeof(header));
 
-BT_CONN_CB_DEFINE(conn_callbacks) = {
-	.connected = connected,
-	.disconnected = disconnected,
-};
+	if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+		shell_error(sh, "Invalid trace");
+		return -EINVAL;
+	}
 
-static void sensor_function(void *, void *, void *)
-{
-	int err;
-	struct bt_le_conn_param *param = BT_LE_CONN_PARAM_DEFAULT;
+	start = k_uptime_get();
 
-	while (1) {
-		k_sem_take(&next_action_sem, K_FOREVER);
+	while ((offset + sizeof(struct trace_record)) <= size) {
+		struct trace_record record;
+		struct bt_gatt_subscribe_params *params = NULL;
+		uint32_t latency = 0;
+		uint32_t cycles;
 
-		if (disabled || busy) {
-			continue;
-		}
+		memcpy(&record, &trace[offset], sizeof(record));
+		offset += sizeof(record);
 
-		/* Check if there are any devices with states that require attention */
-		uint8_t i = 0;
-		while (i < DEVICE_COUNT) {
-			if (devices[i].state == STATE_IDLE) {
-				break;
-			}
+		if ((offset + record.length) > size) {
+			break;
+		}
 
-			++i;
+		if (record.device < device_count && record.field < READING_FIELDS) {
+			params = notification_params(record.device, record.field);
 		}
 
-		if (i == DEVICE_COUNT) {
+		if (params == NULL) {
+			/* Reading is not enabled in this build or device is not in the roster */
+			++skipped;
+			offset += record.length;
 			continue;
 		}
 
-		while (devices[current_index].state != STATE_IDLE) {
-			++current_index;
+		if (realtime) {
+			int64_t delay = (start + record.time) - k_uptime_get();
 
-			if (current_index >= DEVICE_COUNT) {
-				current_index = 0;
+			if (delay > 0) {
+				k_msleep((int32_t)delay);
+			} else {
+				latency = (uint32_t)(-delay) * USEC_PER_MSEC;
 			}
 		}
 
-		busy = true;
-		devices[current_index].state = STATE_CONNECTING;
-
-		/* If we have problems connecting then delay new connection attempts as the device is likely offline */
-		if (connection_failures >= 28) {
-			k_sleep(K_SECONDS(10));
-		} else if (connection_failures > 16) {
-			k_sleep(K_SECONDS(4));
-		} else if (connection_failures > 8) {
-			k_sleep(K_MSEC(800));
-		}
+		params->value_handle = record.handle;
+		cycles = k_cycle_get_32();
+		notification_process(record.device, params, &trace[offset], record.length);
+		cycles = k_cycle_get_32() - cycles;
 
-		err = bt_conn_le_create(&devices[current_index].address, BT_CONN_LE_CREATE_CONN,
-					param, &devices[current_index].connection);
+		busy_cycles += cycles;
+		latency += k_cyc_to_us_ceil32(cycles);
+		++histogram[MIN(find_msb_set(latency), (TRACE_LATENCY_BUCKETS - 1))];
+		latency_min = MIN(latency_min, latency);
+		latency_max = MAX(latency_max, latency);
 
-		if (err) {
-			LOG_ERR("Got error: %d", err);
-			busy = false;
-		}
+		++replayed;
+		offset += record.length;
 	}
-}
 
-static void fan_function(void *, void *, void *)
-{
-	int err;
+	elapsed = k_uptime_get() - start;
+	busy_us = k_cyc_to_us_ceil64(busy_cycles);
 
-	while (1) {
-		k_sem_take(&fan_sem, K_FOREVER);
+	shell_print(sh, "Replayed %u notifications in %lld ms, %u skipped", replayed, elapsed,
+		    skipped);
 
-		if (!pwm_is_ready_dt(&fan_pwm)) {
-			LOG_ERR("Fan PWM is not ready");
-			continue;
-		}
+	if (replayed == 0) {
+		return 0;
+	}
 
-		if (fan_speed == current_fan_speed && half_fan_speed == current_half_fan_speed) {
-			/* We're already done */
-			continue;
-		} else if (fan_speed == 0) {
-			/* Disable, easy. Do this by disabling PWM mode and using GPIO mode */
-			if (pwm_enabled) {
-				err = pwm_set_dt(&fan_pwm, PWM_MAX_PERIOD, 0);
-				err = pm_device_action_run(fan_pwm.dev, PM_DEVICE_ACTION_SUSPEND);
-
-				if (!err) {
-					pwm_enabled = false;
-				} else {
-					LOG_ERR("PWM disable failed: %d", err);
-				}
-			}
+	shell_print(sh, "Sustained rate: %llu notifications/s",
+		    ((uint64_t)replayed * USEC_PER_SEC) / MAX(busy_us, 1));
+	shell_print(sh, "Latency: min %u us, p50 < %u us, p90 < %u us, p99 < %u us, max %u us",
+		    latency_min, trace_percentile(histogram, replayed, 50),
+		    trace_percentile(histogram, replayed, 90),
+		    trace_percentile(histogram, replayed, 99), latency_max);
+
+	while (i < TRACE_LATENCY_BUCKETS) {
+		if (histogram[i] > 0) {
+			shell_print(sh, "%s%6lu us | %u", (i == (TRACE_LATENCY_BUCKETS - 1) ? ">=" : " <"),
+				    (i == (TRACE_LATENCY_BUCKETS - 1) ? BIT(i - 1) : BIT(i)),
+				    histogram[i]);
+		}
 
-			err = gpio_pin_configure_dt(&fan_pin, GPIO_OUTPUT_INACTIVE | NRF_GPIO_DRIVE_H0H1);
+		++i;
+	}
 
-			if (err) {
-				LOG_ERR("GPIO configure failed: %d", err);
-			} else {
-				current_fan_speed = fan_speed;
-			}
-		} else {
-			int8_t change_increment;
-			uint8_t change_amount;
+	return 0;
+}
 
-			if (fan_speed > current_fan_speed) {
-				/* Increase speed gradually until we hit the target */
-				change_increment = 1;
-				change_amount = (fan_speed - current_fan_speed);
-			} else {
-				/* Decrease speed gradually until we hit the target */
-				change_increment = -1;
-				change_amount = (current_fan_speed - fan_speed);
-			}
+/* Replays the built-in trace if there is one, otherwise the recorded trace */
+static int ess_trace_replay_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	uint8_t i = 0;
+	bool realtime = false;
 
-			if (!pwm_enabled) {
-				err = gpio_pin_configure_dt(&fan_pin, GPIO_OUTPUT_INACTIVE);
-				err = pm_device_action_run(fan_pwm.dev, PM_DEVICE_ACTION_RESUME);
+	if (argc == 2) {
+		if (strcmp(argv[1], "realtime") != 0) {
+			shell_error(sh, "Invalid mode, must be realtime");
+			return -EINVAL;
+		}
 
-				if (!err) {
-					pwm_enabled = true;
-				} else {
-					LOG_ERR("PWM enable failed: %d", err);
-				}
-			}
+		realtime = true;
+	}
 
-			while (change_amount > 0) {
-				current_fan_speed = (uint8_t)((int8_t)current_fan_speed + change_increment);
-				err = pwm_set_dt(&fan_pwm, PWM_MAX_PERIOD, (PWM_MAX_PERIOD * current_fan_speed / (half_fan_speed == true ? 200U : 100U)));
+	if (!disabled || trace_recording) {
+		shell_error(sh, "Application must be disabled and trace recording stopped first");
+		return -EBUSY;
+	}
 
-				if (err) {
-					LOG_ERR("PWM set failed: %d (speed: %d)", err, current_fan_speed);
-				}
+	while (i < device_count) {
+		if (devices[i].connection != NULL) {
+			shell_error(sh, "Device #%d is still connected", (device_id_value_offset + i));
+			return -EBUSY;
+		}
 
-				--change_amount;
-				k_sleep(K_MSEC(50));
-			}
+		++i;
+	}
 
-			if (current_fan_speed == 100) {
-				/* Disable PWM mode and use GPIO mode */
-				if (pwm_enabled) {
-					err = pwm_set_dt(&fan_pwm, PWM_MAX_PERIOD, 0);
-					err = pm_device_action_run(fan_pwm.dev, PM_DEVICE_ACTION_SUSPEND);
-
-					if (!err) {
-						pwm_enabled = false;
-					} else {
-						LOG_ERR("PWM disable failed: %d", err);
-					}
-				}
+#ifdef CONFIG_APP_TRACE_REPLAY
+	return trace_replay(sh, replay_trace, sizeof(replay_trace), realtime);
+#else
+	return trace_replay(sh, trace_buffer, trace_used, realtime);
+#endif
+}
+#endif
 
-				err = gpio_pin_configure_dt(&fan_pin, GPIO_OUTPUT_ACTIVE | NRF_GPIO_DRIVE_H0H1);
+#ifdef CONFIG_APP_HISTORY
+struct history_read_context {
+	const struct shell *sh;
+	uint32_t from;
+	uint32_t next;
+};
 
-				if (err) {
-					LOG_ERR("GPIO configure failed: %d", err);
-				}
-			}
+/* Samples of one entry are read at a time, only from the shell thread */
+static struct history_batch history_reading;
 
-			current_half_fan_speed = half_fan_speed;
-		}
+#define HISTORY_ADDRESS_TEXT_SIZE 15
+
+/* Formats the address of a sample as output by "ess status", LOCAL for the local sensor */
+static void history_address_text(const bt_addr_le_t *address, char *text)
+{
+	if (bt_addr_le_cmp(address, BT_ADDR_LE_ANY) == 0) {
+		strcpy(text, "LOCAL");
+	} else {
+		snprintf(text, HISTORY_ADDRESS_TEXT_SIZE, "%02x%02x%02x%02x%02x%02x%02x",
+			 address->type, address->a.val[5], address->a.val[4], address->a.val[3],
+			 address->a.val[2], address->a.val[1], address->a.val[0]);
 	}
 }
 
-int main(void)
+static int history_read_walk(struct fcb_entry_ctx *entry, void *arg)
 {
-	int err;
+	struct history_read_context *context = (struct history_read_context *)arg;
+	const struct history_sample *sample;
+	char address[HISTORY_ADDRESS_TEXT_SIZE];
+	uint32_t sequence;
+	uint8_t i = 0;
 
-	if (!pwm_is_ready_dt(&fan_pwm)) {
-		LOG_ERR("PWM init failed");
-	} else {
-		/* Disable PWM and use as GPIO */
-		err = pwm_set_dt(&fan_pwm, PWM_MAX_PERIOD, 0);
+	if (history_header_read(entry, &history_reading.header) != 0 ||
+	    (history_reading.header.sequence + history_reading.header.count) <= context->from) {
+		return 0;
+	}
 
-		err = pm_device_action_run(fan_pwm.dev, PM_DEVICE_ACTION_SUSPEND);
+	if (flash_area_read(entry->fap, FCB_ENTRY_FA_DATA_OFF(entry->loc), &history_reading,
+			    entry->loc.fe_data_len) != 0) {
+		return 0;
+	}
 
-		if (!err) {
-			pwm_enabled = false;
+	while (i < history_reading.header.count) {
+		sample = &history_reading.samples[i];
+		sequence = history_reading.header.sequence + i;
+
+		if (sequence >= context->from) {
+			history_address_text(&sample->address, address);
+			shell_print(context->sh, "%u,%u,%s,%u,%d,%u,%u,%d,%u", sequence,
+				    sys_le32_to_cpu(sample->time), address,
+				    sample->readings.received,
+				    (int16_t)sys_le16_to_cpu(sample->readings.temperature),
+				    sys_le16_to_cpu(sample->readings.humidity),
+				    sys_le32_to_cpu(sample->readings.pressure),
+				    sample->readings.dew_point, sample->readings.battery_level);
+			context->next = sequence + 1;
 		}
 
-		err = gpio_pin_configure_dt(&fan_pin, GPIO_OUTPUT_INACTIVE);
-
+		++i;
 	}
 
-	err = bt_enable(NULL);
+	return 0;
+}
+
+static int history_oldest_walk(struct fcb_entry_ctx *entry, void *arg)
+{
+	struct history_header header;
 
-	if (err) {
-		LOG_ERR("Bluetooth init failed (err %d)", err);
+	if (history_header_read(entry, &header) != 0) {
 		return 0;
 	}
 
-	LOG_ERR("Bluetooth initialized");
+	*((uint32_t *)arg) = header.sequence;
 
-	k_sem_init(&next_action_sem, 1, 1);
-	k_sem_init(&fan_sem, 0, 1);
-	k_work_init(&subscribe_workqueue, subscribe_work);
+	/* Stop at the first valid entry */
+	return 1;
+}
 
-/* */
-	current_index = 0;
+#ifdef CONFIG_APP_HISTORY_EXPORT
+/* Bulk export, each block is a varint sequence number and sample count followed by the samples
+ * and a CRC32 of everything before it, output as a line of base64 prefixed with "@". Within a
+ * block each sample is a zigzag varint time delta from the previous sample, the number of the
+ * device within the block, a mask of the fields which differ from the previous sample of the
+ * same device in the block, the 7 byte address (type then address, least significant byte
+ * first, all zero for the local sensor) if this is the first sample of the device in the block,
+ * and a zigzag varint delta of each of those fields. The first sample of a device in a block is
+ * relative to the sample before it, as devices tend to read similar values, or to 0 for the
+ * first sample of the block. Blocks do not depend on each other, so an export can be resumed
+ * from the sequence number after the last good block
+ */
+#define HISTORY_EXPORT_SAMPLES 32
+#define HISTORY_EXPORT_HEADER_MAX 10
+#define HISTORY_EXPORT_SAMPLE_MAX 34
+#define HISTORY_EXPORT_BLOCK_MAX (HISTORY_EXPORT_HEADER_MAX + \
+				  (HISTORY_EXPORT_SAMPLES * HISTORY_EXPORT_SAMPLE_MAX) + \
+				  sizeof(uint32_t))
+#define HISTORY_EXPORT_TEXT_MAX ((((HISTORY_EXPORT_BLOCK_MAX + 2) / 3) * 4) + 1)
+
+enum history_export_field_t {
+	HISTORY_FIELD_RECEIVED,
+	HISTORY_FIELD_TEMPERATURE,
+	HISTORY_FIELD_HUMIDITY,
+	HISTORY_FIELD_PRESSURE,
+	HISTORY_FIELD_DEW_POINT,
+	HISTORY_FIELD_BATTERY_LEVEL,
+};
 
-	while (current_index < DEVICE_COUNT) {
-		devices[current_index].state = STATE_IDLE;
-		devices[current_index].handles.status = 0;
-		memset(&devices[current_index].handles, 0, sizeof(struct device_handles));
-		++current_index;
-	}
+struct history_export_context {
+	const struct shell *sh;
+	uint32_t from;
+	uint32_t next;
+	uint32_t sequence; /* Sequence number of the first sample in the block */
+	uint8_t count;
+	uint16_t length;
+	uint32_t time;
+	uint8_t devices;
+	uint8_t last; /* Index in previous of the last sample */
+	bt_addr_le_t addresses[HISTORY_EXPORT_SAMPLES]; /* Of each device, by number in the block */
+	struct packed_readings previous[HISTORY_EXPORT_SAMPLES];
+	uint8_t samples[HISTORY_EXPORT_SAMPLES * HISTORY_EXPORT_SAMPLE_MAX];
+};
 
-	current_index = 0;
+/* Only used from the shell thread */
+static struct history_export_context history_export;
+static uint8_t history_export_block[HISTORY_EXPORT_BLOCK_MAX];
+static char history_export_text[HISTORY_EXPORT_TEXT_MAX];
 
-#ifndef CONFIG_APP_START_BOOTUP
-	disabled = true;
-#endif
+static uint16_t varint_put(uint8_t *buffer, uint32_t value)
+{
+	uint16_t length = 0;
 
-	/* Setup threads */
-	sensor_thread_id = k_thread_create(&sensor_thread, sensor_thread_stack,
-					   K_THREAD_STACK_SIZEOF(sensor_thread_stack),
-					   sensor_function, NULL, NULL, NULL,
-					   SENSOR_THREAD_PRIORITY, 0, K_NO_WAIT);
+	while (value >= 0x80) {
+		buffer[length] = (uint8_t)(value | 0x80);
+		value >>= 7;
+		++length;
+	}
 
-	fan_thread_id = k_thread_create(&fan_thread, fan_thread_stack,
-					K_THREAD_STACK_SIZEOF(fan_thread_stack),
-					fan_function, NULL, NULL, NULL,
-					FAN_THREAD_PRIORITY, 0, K_NO_WAIT);
+	buffer[length] = (uint8_t)value;
 
-	if (!device_is_ready(dht22)) {
-		LOG_ERR("Sensor init failed");
-	} else {
-		/* Read 5 sets of readings due to sensor being of incredibly shit quality and
-		 * giving many bogus readings
-		 */
-		uint8_t i = 0;
+	return (length + 1);
+}
 
-		while (i < 3) {
-			/* Don't bother checking return code, not like the sensor manufacturer
-			 * cares to check if their product is of any actual use...
-			 */
-			err = sensor_sample_fetch(dht22);
-			k_sleep(K_MSEC(1200));
+static uint32_t zigzag(int32_t value)
+{
+	return (((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
 
-			++i;
-		}
+/* Adds a field to the current sample if it differs from the previous sample of the device */
+static void history_export_field(uint8_t *mask, enum history_export_field_t field, int32_t value,
+				 int32_t previous)
+{
+	if (value != previous) {
+		*mask |= BIT(field);
+		history_export.length += varint_put(&history_export.samples[history_export.length],
+						    zigzag(value - previous));
+	}
+}
+
+/* Outputs the current block, if it has any samples */
+static void history_export_emit(void)
+{
+	uint16_t length = 0;
+	uint32_t crc;
+	size_t text_length;
 
-		last_dht_reading_pass = (err ? false : true);
+	if (history_export.count == 0) {
+		return;
 	}
 
-	return 0;
+	length += varint_put(&history_export_block[length], history_export.sequence);
+	length += varint_put(&history_export_block[length], history_export.count);
+	memcpy(&history_export_block[length], history_export.samples, history_export.length);
+	length += history_export.length;
+	crc = sys_cpu_to_le32(crc32_ieee(history_export_block, length));
+	memcpy(&history_export_block[length], &crc, sizeof(crc));
+	length += sizeof(crc);
+
+	if (base64_encode(history_export_text, sizeof(history_export_text), &text_length,
+			  history_export_block, length) == 0) {
+		shell_print(history_export.sh, "@%s", history_export_text);
+	}
+
+	history_export.next = history_export.sequence + history_export.count;
+	history_export.count = 0;
 }
 
-#if defined(CONFIG_APP_OUTPUT_FORMAT_CUSTOM)
-/* Outputs ESS readings in the following format:
- * Start delimiter: ##
- * { for each device with data:
- *     Index number: e.g. 0
- *     Temperature reading: e.g. 25.12
- *     Pressure reading: e.g. 1000270
- *     Humidity reading: e.g. 52.04
- *     Dew point reading: e.g. 8
- * }
- * End delimiter: ^^
- *
- * Each value has a comma (,) separator.
- */
-static int ess_readings_handler(const struct shell *sh, size_t argc, char **argv)
+static void history_export_add(uint32_t sequence, const struct history_sample *sample)
 {
+	const struct packed_readings *readings = &sample->readings;
+	struct packed_readings *previous = NULL;
+	uint32_t time = sys_le32_to_cpu(sample->time);
+	uint16_t mask_offset;
+	uint8_t mask = 0;
 	uint8_t i = 0;
-	uint8_t buffer[128] = {0};
+	bool first = false;
 
-	while (i < DEVICE_COUNT) {
-		if (devices[i].state == STATE_ACTIVE &&
-		    devices[i].readings.received == RECEIVED_ALL) {
-			sprintf(&buffer[strlen(buffer)], "%d,"
-#ifdef CONFIG_APP_ESS_TEMPERATURE
-				"%.2f,"
-#endif
-#ifdef CONFIG_APP_ESS_HUMIDITY
-				"%.0f,"
-#endif
-#ifdef CONFIG_APP_ESS_PRESSURE
-				"%.2f,"
-#endif
-#ifdef CONFIG_APP_ESS_DEW_POINT
-				"%d,"
-#endif
-#ifdef CONFIG_APP_ESS_BATTERY_LEVEL
-				"%d,"
-#endif
-				, i
-#ifdef CONFIG_APP_ESS_TEMPERATURE
-				, devices[i].readings.temperature
-#endif
-#ifdef CONFIG_APP_ESS_HUMIDITY
-				, devices[i].readings.humidity
-#endif
-#ifdef CONFIG_APP_ESS_PRESSURE
-				, devices[i].readings.pressure
-#endif
-#ifdef CONFIG_APP_ESS_DEW_POINT
-				, devices[i].readings.dew_point
-#endif
-#ifdef CONFIG_APP_ESS_BATTERY_LEVEL
-				, devices[i].readings.battery_level
-#endif
-				);
-			devices[i].readings.received = RECEIVED_NONE;
+	if (history_export.count == 0) {
+		history_export.sequence = sequence;
+		history_export.length = 0;
+		history_export.time = 0;
+		history_export.devices = 0;
+	}
+
+	while (i < history_export.devices) {
+		if (bt_addr_le_cmp(&history_export.addresses[i], &sample->address) == 0) {
+			previous = &history_export.previous[i];
+			break;
 		}
 
 		++i;
 	}
 
-/* Should do sht22 here */
+	if (previous == NULL) {
+		previous = &history_export.previous[history_export.devices];
+
+		if (history_export.devices == 0) {
+			memset(previous, 0, sizeof(struct packed_readings));
+		} else {
+			memcpy(previous, &history_export.previous[history_export.last],
+			       sizeof(struct packed_readings));
+		}
 
-	if (strlen(buffer) > 0) {
-		buffer[(strlen(buffer) - 1)] = 0;
+		i = history_export.devices;
+		bt_addr_le_copy(&history_export.addresses[i], &sample->address);
+		++history_export.devices;
+		first = true;
 	}
 
-	shell_print(sh, "##%s^^", buffer);
+	history_export.last = i;
 
-	return 0;
+	history_export.length += varint_put(&history_export.samples[history_export.length],
+					    zigzag((int32_t)(time - history_export.time)));
+	history_export.time = time;
+	history_export.samples[history_export.length] = i;
+	mask_offset = history_export.length + 1;
+	history_export.length += 2;
+
+	if (first) {
+		history_export.samples[history_export.length] = sample->address.type;
+		memcpy(&history_export.samples[history_export.length + 1], sample->address.a.val,
+		       sizeof(sample->address.a.val));
+		history_export.length += sizeof(bt_addr_le_t);
+	}
+
+	history_export_field(&mask, HISTORY_FIELD_RECEIVED, readings->received,
+			     previous->received);
+	history_export_field(&mask, HISTORY_FIELD_TEMPERATURE,
+			     (int16_t)sys_le16_to_cpu(readings->temperature),
+			     (int16_t)sys_le16_to_cpu(previous->temperature));
+	history_export_field(&mask, HISTORY_FIELD_HUMIDITY, sys_le16_to_cpu(readings->humidity),
+			     sys_le16_to_cpu(previous->humidity));
+	history_export_field(&mask, HISTORY_FIELD_PRESSURE,
+			     (int32_t)sys_le32_to_cpu(readings->pressure),
+			     (int32_t)sys_le32_to_cpu(previous->pressure));
+	history_export_field(&mask, HISTORY_FIELD_DEW_POINT, readings->dew_point,
+			     previous->dew_point);
+	history_export_field(&mask, HISTORY_FIELD_BATTERY_LEVEL, readings->battery_level,
+			     previous->battery_level);
+	history_export.samples[mask_offset] = mask;
+
+	memcpy(previous, readings, sizeof(struct packed_readings));
+	++history_export.count;
+
+	if (history_export.count == HISTORY_EXPORT_SAMPLES) {
+		history_export_emit();
+	}
 }
-#elif defined(CONFIG_APP_OUTPUT_FORMAT_CSV)
-/* Outputs ESS readings in CSV format, with headings */
-static int ess_readings_handler(const struct shell *sh, size_t argc, char **argv)
+
+static int history_export_walk(struct fcb_entry_ctx *entry, void *arg)
 {
 	uint8_t i = 0;
-	uint8_t buffer[384] = {0};
-	int err;
-	struct sensor_value humidity;
-	struct sensor_value temperature;
 
-	sprintf(&buffer[0], "device,"
-#if defined(CONFIG_APP_OUTPUT_DEVICE_ADDRESS)
-		"address,"
-#endif
-#if defined(CONFIG_APP_OUTPUT_DEVICE_NAME)
-		"name,"
-#endif
-#ifdef CONFIG_APP_ESS_TEMPERATURE
-		"temperature,"
-#endif
-#ifdef CONFIG_APP_ESS_HUMIDITY
-		"humidity,"
-#endif
-#ifdef CONFIG_APP_ESS_PRESSURE
-		"pressure,"
-#endif
-#ifdef CONFIG_APP_ESS_DEW_POINT
-		"dewpoint,"
-#endif
-#ifdef CONFIG_APP_BATTERY_LEVEL
-		"battery,"
-#endif
-		"\n");
+	if (history_header_read(entry, &history_reading.header) != 0 ||
+	    (history_reading.header.sequence + history_reading.header.count) <= history_export.from) {
+		return 0;
+	}
 
-	/* Read rubbish connected sensor */
-	err = sensor_sample_fetch(dht22);
+	if (flash_area_read(entry->fap, FCB_ENTRY_FA_DATA_OFF(entry->loc), &history_reading,
+			    entry->loc.fe_data_len) != 0) {
+		return 0;
+	}
 
-	while (i < DEVICE_COUNT) {
-		if (devices[i].state == STATE_ACTIVE &&
-		    devices[i].readings.received == RECEIVED_ALL) {
-			sprintf(&buffer[strlen(buffer)], "%d,"
-#if defined(CONFIG_APP_OUTPUT_DEVICE_ADDRESS)
-				"%02x%02x%02x%02x%02x%02x%02x,"
-#endif
-#if defined(CONFIG_APP_OUTPUT_DEVICE_NAME)
-				"%s,"
-#endif
-#ifdef CONFIG_APP_ESS_TEMPERATURE
-				"%.2f,"
-#endif
-#ifdef CONFIG_APP_ESS_HUMIDITY
-				"%.2f,"
-#endif
-#ifdef CONFIG_APP_ESS_PRESSURE
-				"%.0f,"
-#endif
-#ifdef CONFIG_APP_ESS_DEW_POINT
-				"%d,"
-#endif
-#ifdef CONFIG_APP_BATTERY_LEVEL
-				"%d,"
-#endif
-				"\n", (device_id_value_offset + i)
-#if defined(CONFIG_APP_OUTPUT_DEVICE_ADDRESS)
-				, devices[i].address.type, devices[i].address.a.val[5],
-				devices[i].address.a.val[4], devices[i].address.a.val[3],
-				devices[i].address.a.val[2], devices[i].address.a.val[1],
-				devices[i].address.a.val[0]
-#endif
-#if defined(CONFIG_APP_OUTPUT_DEVICE_NAME)
-				, devices[i].name
-#endif
-#ifdef CONFIG_APP_ESS_TEMPERATURE
-				, devices[i].readings.temperature
-#endif
-#ifdef CONFIG_APP_ESS_HUMIDITY
-				, devices[i].readings.humidity
-#endif
-#ifdef CONFIG_APP_ESS_PRESSURE
-				, devices[i].readings.pressure
-#endif
-#ifdef CONFIG_APP_ESS_DEW_POINT
-				, devices[i].readings.dew_point
-#endif
-#ifdef CONFIG_APP_BATTERY_LEVEL
-				, devices[i].readings.battery_level
-#endif
-				);
-			devices[i].readings.received = RECEIVED_NONE;
+	while (i < history_reading.header.count) {
+		if ((history_reading.header.sequence + i) >= history_export.from) {
+			if (history_export.count > 0 &&
+			    (history_export.sequence + history_export.count) !=
+			    (history_reading.header.sequence + i)) {
+				/* Samples in a block must be consecutive */
+				history_export_emit();
+			}
+
+			history_export_add((history_reading.header.sequence + i),
+					   &history_reading.samples[i]);
 		}
 
 		++i;
 	}
 
-	if (err) {
-		/* Wait a short period of time and try again */
-		k_sleep(K_MSEC(300));
-		err = sensor_sample_fetch(dht22);
-	}
-
-	last_dht_reading_pass = (err ? false : true);
+	return 0;
+}
+#endif
 
-	if (!err) {
-		(void)sensor_channel_get(dht22, SENSOR_CHAN_AMBIENT_TEMP, &temperature);
-		(void)sensor_channel_get(dht22, SENSOR_CHAN_HUMIDITY, &humidity);
+static int ess_history_status_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	uint32_t oldest;
+	uint32_t next;
+	uint8_t pending;
 
-		sprintf(&buffer[strlen(buffer)], "%d,"
-#if defined(CONFIG_APP_OUTPUT_DEVICE_ADDRESS)
-			"LOCAL,"
-#endif
-#if defined(CONFIG_APP_OUTPUT_DEVICE_NAME)
-			"Loft,"
-#endif
-#ifdef CONFIG_APP_ESS_TEMPERATURE
-			"%.2f,"
-#endif
-#ifdef CONFIG_APP_ESS_HUMIDITY
-			"%.2f,"
-#endif
-#ifdef CONFIG_APP_ESS_PRESSURE
-			"0,"
-#endif
-#ifdef CONFIG_APP_ESS_DEW_POINT
-			"0,"
-#endif
-#ifdef CONFIG_APP_BATTERY_LEVEL
-			"0,"
-#endif
-			"\n", (device_id_value_offset + i)
-#ifdef CONFIG_APP_ESS_TEMPERATURE
-			, sensor_value_to_double(&temperature)
-#endif
-#ifdef CONFIG_APP_ESS_HUMIDITY
-			, sensor_value_to_double(&humidity)
-#endif
-			);
+	if (!history_ready) {
+		shell_error(sh, "History log is not available");
+		return -ENODEV;
 	}
 
-	shell_print(sh, "%s\n", buffer);
+	k_mutex_lock(&history_lock, K_FOREVER);
+	next = history_pending.header.sequence + history_pending.header.count;
+	pending = history_pending.header.count;
+	k_mutex_unlock(&history_lock);
+	oldest = next;
+	(void)fcb_walk(&history_fcb, NULL, history_oldest_walk, &oldest);
+
+	shell_print(sh, "Oldest: %u", oldest);
+	shell_print(sh, "Next: %u", next);
+	shell_print(sh, "Acknowledged: %u", history_acknowledged);
+	shell_print(sh, "Pending: %u", pending);
+	shell_print(sh, "Dropped: %u", history_dropped);
+	shell_print(sh, "Free sectors: %d/%u", fcb_free_sector_cnt(&history_fcb),
+		    history_fcb.f_sector_cnt);
 
 	return 0;
 }
-#else
-#error "Invalid output format selected"
-#endif
 
-static int ess_disconnect_handler(const struct shell *sh, size_t argc, char **argv)
+static int ess_history_read_handler(const struct shell *sh, size_t argc, char **argv)
 {
-	uint8_t i = 0;
-
-	while (i < DEVICE_COUNT) {
-		if (devices[i].state != STATE_IDLE && devices[i].connection != NULL) {
-			int32_t err = bt_conn_disconnect(devices[i].connection, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	struct history_read_context context;
 
-			if (err != 0) {
-				shell_error(sh, "Error whilst disconnecting from #%d: %d", i, err);
-			}
-		}
-
-		++i;
+	if (!history_ready) {
+		shell_error(sh, "History log is not available");
+		return -ENODEV;
 	}
 
-	shell_print(sh, "Disconnected from all devices");
+	context.sh = sh;
+	context.from = (argc == 2 ? (uint32_t)strtoul(argv[1], NULL, 0) : history_acknowledged);
+	context.next = context.from;
+
+	shell_print(sh, "sequence,time,address,received,temperature,humidity,pressure,dew_point,"
+		    "battery_level");
+	(void)fcb_walk(&history_fcb, NULL, history_read_walk, &context);
+	shell_print(sh, "Next: %u", context.next);
 
 	return 0;
 }
 
-static int ess_disable_handler(const struct shell *sh, size_t argc, char **argv)
+#ifdef CONFIG_APP_HISTORY_EXPORT
+static int ess_history_export_handler(const struct shell *sh, size_t argc, char **argv)
 {
-	if (!disabled) {
-		uint8_t i = 0;
-		disabled = true;
+	if (!history_ready) {
+		shell_error(sh, "History log is not available");
+		return -ENODEV;
+	}
 
-		while (i < DEVICE_COUNT) {
-			if (devices[i].state != STATE_IDLE && devices[i].connection != NULL) {
-				int32_t err = bt_conn_disconnect(devices[i].connection, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	history_export.sh = sh;
+	history_export.from = (argc == 2 ? (uint32_t)strtoul(argv[1], NULL, 0) :
+			       history_acknowledged);
+	history_export.next = history_export.from;
+	history_export.count = 0;
 
-				if (err != 0) {
-					shell_error(sh, "Error whilst disconnecting from #%d: %d", i, err);
-				}
-			}
+	(void)fcb_walk(&history_fcb, NULL, history_export_walk, NULL);
+	history_export_emit();
+	shell_print(sh, "Next: %u", history_export.next);
 
-			++i;
-		}
+	return 0;
+}
+#endif
 
-		shell_print(sh, "Application state changed to disabled.");
+static int ess_history_ack_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	history_acknowledge((uint32_t)strtoul(argv[1], NULL, 0));
 
-		return 0;
+	return 0;
+}
+
+static int ess_history_flush_handler(const struct shell *sh, size_t argc, char **argv)
+{
+	struct k_work_sync sync;
+
+	if (!history_ready) {
+		shell_error(sh, "History log is not available");
+		return -ENODEV;
 	}
 
-	shell_error(sh, "Application is already disabled.");
+	(void)k_work_reschedule(&history_flush_work, K_NO_WAIT);
+	(void)k_work_flush_delayable(&history_flush_work, &sync);
 
-	return -EPERM;
+	return 0;
 }
 
-static int ess_enable_handler(const struct shell *sh, size_t argc, char **argv)
+static int ess_history_erase_handler(const struct shell *sh, size_t argc, char **argv)
 {
-	if (disabled) {
-		disabled = false;
-		shell_print(sh, "Application state changed to enabled.");
-		k_sem_give(&next_action_sem);
-		return 0;
+	int err;
+
+	if (!history_ready) {
+		shell_error(sh, "History log is not available");
+		return -ENODEV;
 	}
 
-	shell_error(sh, "Application is already enabled.");
+	err = fcb_clear(&history_fcb);
 
-	return -EPERM;
+	if (err) {
+		shell_error(sh, "Erase failed: %d", err);
+		return err;
+	}
+
+	history_acknowledge(0);
+	shell_print(sh, "History erased");
+
+	return 0;
 }
+#endif
 
-static char *state_to_text(uint8_t state)
+#ifdef CONFIG_APP_ALARMS
+static int ess_alarm_list_handler(const struct shell *sh, size_t argc, char **argv)
 {
-	if (state == STATE_IDLE) {
-		return "Idle";
-	} else if (state == STATE_CONNECTING) {
-		return "Connecting";
-	} else if (state == STATE_CONNECTED) {
-		return "Connected";
-	} else if (state == STATE_DISCOVERING) {
-		return "Discovering";
-	} else if (state == STATE_ACTIVE) {
-		return "Active";
+	uint8_t i = 0;
+
+	shell_print(sh, "# | Device         | Field       | Condition      | Hysteresis | Fan  | State     | Count");
+	shell_print(sh, "--|----------------|-------------|----------------|------------|------|-----------|------");
+
+	k_mutex_lock(&alarm_lock, K_FOREVER);
+
+	while (i < ALARM_RULES) {
+		const struct alarm_rule *rule = &alarm_rules[i];
+		char device[16];
+		char fan[5];
+
+		if (!rule->used) {
+			++i;
+			continue;
+		}
+
+		if (rule->local) {
+			strcpy(device, "LOCAL");
+		} else {
+			snprintf(device, sizeof(device), "%02x%02x%02x%02x%02x%02x%02x",
+				 rule->address.type, rule->address.a.val[5], rule->address.a.val[4],
+				 rule->address.a.val[3], rule->address.a.val[2],
+				 rule->address.a.val[1], rule->address.a.val[0]);
+		}
+
+		if (rule->fan_speed == ALARM_FAN_NONE) {
+			strcpy(fan, "-");
+		} else {
+			snprintf(fan, sizeof(fan), "%d", rule->fan_speed);
+		}
+
+		shell_print(sh, "%d | %-14s | %-11s | %s %9.2f | %10.2f | %4s | %-9s | %5u", (i + 1),
+			    device, field_names[rule->field],
+			    (rule->direction == ALARM_ABOVE ? "above" : "below"),
+			    (double)rule->threshold, (double)rule->hysteresis, fan,
+			    (alarm_triggered[i] ? "Triggered" : "Clear"), alarm_counts[i]);
+		++i;
 	}
 
-	return "Unknown";
+	k_mutex_unlock(&alarm_lock);
+
+	return 0;
 }
 
-static int ess_status_handler(const struct shell *sh, size_t argc, char **argv)
+static int ess_alarm_add_handler(const struct shell *sh, size_t argc, char **argv)
 {
+	struct alarm_rule rule;
 	uint8_t i = 0;
-	uint8_t largest_name = 0;
-	int8_t repeat_size;
 
-	while (i < DEVICE_COUNT) {
-		uint8_t string_size;
+	memset(&rule, 0, sizeof(rule));
+	rule.used = true;
+	rule.fan_speed = ALARM_FAN_NONE;
 
-		string_size = (uint8_t)strlen(devices[i].name);
+	if (strcmp(argv[1], "local") == 0) {
+		rule.local = true;
+	} else {
+		uint32_t device = strtoul(argv[1], NULL, 0);
 
-		if (string_size > largest_name) {
-			largest_name = string_size;
+		if (device < device_id_value_offset ||
+		    device >= (device_id_value_offset + device_count)) {
+			shell_error(sh, "Invalid device");
+			return -EINVAL;
+		}
+
+		bt_addr_le_copy(&rule.address, &devices[device - device_id_value_offset].address);
+	}
+
+	while (i < READING_FIELDS) {
+		if ((RECEIVED_ALL & BIT(i)) && strcmp(argv[2], field_names[i]) == 0) {
+			break;
 		}
 
 		++i;
 	}
 
+	if (i == READING_FIELDS) {
+		shell_error(sh, "Invalid field");
+		return -EINVAL;
+	}
 
-	repeat_size = (int8_t)largest_name - 4;
-	if (repeat_size < 0) {
-		repeat_size = 0;
+	rule.field = i;
+
+	if (strcmp(argv[3], "above") == 0) {
+		rule.direction = ALARM_ABOVE;
+	} else if (strcmp(argv[3], "below") == 0) {
+		rule.direction = ALARM_BELOW;
+	} else {
+		shell_error(sh, "Invalid condition, must be above or below");
+		return -EINVAL;
 	}
 
-	shell_print(sh, "# | Address        | Name%.*s | State       | Readings", repeat_size, "                  ");
-	shell_print(sh, "--|----------------|-----%.*s-|-------------|---------", repeat_size, "------------------");
+	rule.threshold = strtof(argv[4], NULL);
+	rule.hysteresis = strtof(argv[5], NULL);
 
-	i = 0;
+	if (rule.hysteresis < 0.0f) {
+		shell_error(sh, "Invalid hysteresis");
+		return -EINVAL;
+	}
 
-	while (i < DEVICE_COUNT) {
-		char *state = state_to_text(devices[i].state);
+	if (argc == 7) {
+		uint32_t speed = strtoul(argv[6], NULL, 0);
 
-		shell_print(sh, "%d | %02x%02x%02x%02x%02x%02x%02x | %s%.*s | %s%.*s | 0x%x %s",
-			    (device_id_value_offset + i),
-			    devices[i].address.type, devices[i].address.a.val[5],
-			    devices[i].address.a.val[4], devices[i].address.a.val[3],
-			    devices[i].address.a.val[2], devices[i].address.a.val[1],
-			    devices[i].address.a.val[0], devices[i].name,
-			    (largest_name - strlen(devices[i].name)), "                  ",
-			    state, (11 - strlen(state)), "                  ",
-			    devices[i].readings.received,
-			    (devices[i].readings.received == RECEIVED_ALL ? tick_character : ""));
+		if (speed > FAN_SPEED_MAX) {
+			shell_error(sh, "Invalid speed, must be between 0-100");
+			return -EINVAL;
+		}
+
+		rule.fan_speed = (int8_t)speed;
+	}
+
+	k_mutex_lock(&alarm_lock, K_FOREVER);
+	i = 0;
+
+	while (i < ALARM_RULES && alarm_rules[i].used) {
 		++i;
 	}
 
-	if (device_is_ready(dht22) && last_dht_reading_pass == true) {
-		shell_print(sh, "%d | LOCAL          | Loft%.*s | Active      | 0x%x %s", (device_id_value_offset + i),
-			    (largest_name - 4), "                  ", (0
-#ifdef CONFIG_APP_ESS_TEMPERATURE
-			    + RECEIVED_TEMPERATURE
-#endif
-#ifdef CONFIG_APP_ESS_HUMIDITY
-			    + RECEIVED_HUMIDITY
-#endif
-			    ), tick_character);
-	} else {
-		shell_print(sh, "%d | LOCAL          | Loft%.*s | Error       | 0x0", (device_id_value_offset + i),
-			    (largest_name - 4), "                  ");
+	if (i == ALARM_RULES) {
+		k_mutex_unlock(&alarm_lock);
+		shell_error(sh, "No free rules");
+		return -ENOMEM;
 	}
 
+	memcpy(&alarm_rules[i], &rule, sizeof(rule));
+	alarm_triggered[i] = false;
+	alarm_counts[i] = 0;
+	alarm_save();
+	k_mutex_unlock(&alarm_lock);
+
+	shell_print(sh, "Added as rule %d", (i + 1));
+
 	return 0;
 }
 
-static int fan_speed_handler(const struct shell *sh, size_t argc, char **argv)
+static int ess_alarm_remove_handler(const struct shell *sh, size_t argc, char **argv)
 {
-	if (argc == 1) {
-		if (half_fan_speed == true) {
-			shell_print(sh, "Fan speed: %u (half)", fan_speed);
-		} else {
-			shell_print(sh, "Fan speed: %u", fan_speed);
-		}
-	} else if (strcmp(argv[1], "actual") == 0) {
-		if (half_fan_speed == true) {
-			shell_print(sh, "Actual fan speed: %u (half)", current_fan_speed);
-		} else {
-			shell_print(sh, "Actual fan speed: %u", current_fan_speed);
-		}
-	} else {
-		uint32_t speed = strtoul(argv[1], NULL, 0);
+	uint32_t rule = strtoul(argv[1], NULL, 0);
 
-		if (speed > 100) {
-			shell_print(sh, "Invalid speed, must be between 0-100");
-		} else {
-			if (argc == 3) {
-				if (strcmp(argv[2], "half") == 0) {
-					half_fan_speed = true;
-				} else {
-					shell_error(sh, "Invalid option");
-					return -EINVAL;
-				}
-			} else {
-				half_fan_speed = false;
-			}
+	if (rule < 1 || rule > ALARM_RULES || !alarm_rules[rule - 1].used) {
+		shell_error(sh, "Invalid rule");
+		return -EINVAL;
+	}
 
-			fan_speed = (uint8_t)speed;
-			k_sem_give(&fan_sem);
-			shell_print(sh, "Fan speed set");
-		}
+	k_mutex_lock(&alarm_lock, K_FOREVER);
+	memset(&alarm_rules[rule - 1], 0, sizeof(struct alarm_rule));
+	alarm_save();
+
+	if (alarm_triggered[rule - 1]) {
+		/* Puts the fan back if this rule was forcing it */
+		alarm_triggered[rule - 1] = false;
+		alarm_fan_update();
 	}
 
+	k_mutex_unlock(&alarm_lock);
+
+	shell_print(sh, "Rule removed");
+
 	return 0;
 }
+#endif
 
-static int app_reboot_handler(const struct shell *sh, size_t argc, char **argv)
+#ifdef CONFIG_APP_ADAPTIVE_PHY
+static const char *phy_to_text(uint8_t phy)
 {
-        sys_reboot(SYS_REBOOT_COLD);
-
-	return 0;
+	switch (phy) {
+		case BT_GAP_LE_PHY_1M:
+		{
+			return "1M";
+		}
+		case BT_GAP_LE_PHY_2M:
+		{
+			return "2M";
+		}
+		case BT_GAP_LE_PHY_CODED:
+		{
+			return "Coded";
+		}
+		default:
+		{
+			return "-";
+		}
+	};
 }
 
-static int app_bootloader_handler(const struct shell *sh, size_t argc, char **argv)
+static int ess_phy_handler(const struct shell *sh, size_t argc, char **argv)
 {
-	int err;
+	uint8_t i = 0;
+	uint32_t device;
 
-	if (!gpio_is_ready_dt(&reset)) {
-		shell_print(sh, "GPIO is not ready");
-	} else {
-		err = gpio_pin_configure_dt(&reset, GPIO_OUTPUT_ACTIVE);
+	if (argc == 1) {
+		shell_print(sh, "# | Policy | PHY   | Failure streak");
+		shell_print(sh, "--|--------|-------|---------------");
 
-		if (err < 0) {
-			shell_print(sh, "GPIO set failed");
+		while (i < device_count) {
+			shell_print(sh, "%d | %-6s | %-5s | %u", (device_id_value_offset + i),
+				    phy_policy_names[devices[i].phy_policy],
+				    phy_to_text(devices[i].phy), devices[i].failure_streak);
+			++i;
+		}
+
+		return 0;
+	}
+
+	if (argc != 3) {
+		shell_error(sh, "Both a device and a policy are needed");
+		return -EINVAL;
+	}
+
+	device = strtoul(argv[1], NULL, 0);
+
+	if (device < device_id_value_offset || device >= (device_id_value_offset + device_count)) {
+		shell_error(sh, "Invalid device");
+		return -EINVAL;
+	}
+
+	while (i < PHY_POLICY_COUNT) {
+		if (strcmp(argv[2], phy_policy_names[i]) == 0) {
+			break;
 		}
+
+		++i;
+	}
+
+	if (i == PHY_POLICY_COUNT) {
+		shell_error(sh, "Invalid policy, must be auto, 1m, 2m or coded");
+		return -EINVAL;
 	}
 
+	/* Takes effect at the next RSSI sample or connection */
+	devices[device - device_id_value_offset].phy_policy = (enum phy_policy_t)i;
+	shell_print(sh, "PHY policy set");
+
 	return 0;
 }
+#endif
 
-static int app_version_handler(const struct shell *sh, size_t argc, char **argv)
+#ifdef CONFIG_APP_CONN_PLANNER
+static int ess_plan_handler(const struct shell *sh, size_t argc, char **argv)
 {
-	shell_print(sh, "Version: %s", APP_VERSION_TWEAK_STRING);
+	uint8_t i = 0;
+	uint32_t interval;
+	uint32_t actual;
+	uint32_t window;
+	uint32_t load;
+
+	/* 1.25 ms units are shown in hundredths of a ms */
+	interval = (CONFIG_APP_CONN_PLANNER_BASE_INTERVAL * 125);
+	load = plan_load(DEVICE_SLOTS);
+	shell_print(sh, "Base interval %u.%02u ms, %u events of %u us, %u kept for scanning",
+		    (interval / 100), (interval % 100), PLAN_SLOTS,
+		    CONFIG_APP_CONN_PLANNER_EVENT_LENGTH, CONFIG_APP_CONN_PLANNER_SCAN_SLOTS);
+	shell_print(sh, "Up to %u links, using %u.%u events per base interval, anchor points are "
+		    "placed by the controller", CENTRAL_LINKS_MAX, (load / PLAN_CYCLES),
+		    (((load % PLAN_CYCLES) * 10U) / PLAN_CYCLES));
+	shell_print(sh, "# | Planned (ms) | Actual (ms)");
+	shell_print(sh, "--|--------------|------------");
+
+	while (i < device_count) {
+		if (devices[i].state != STATE_IDLE && devices[i].plan.planned) {
+			interval = ((CONFIG_APP_CONN_PLANNER_BASE_INTERVAL * 125) <<
+				    devices[i].plan.exponent);
+			actual = (devices[i].plan.interval * 125);
+			shell_print(sh, "%d | %9u.%02u | %8u.%02u", (device_id_value_offset + i),
+				    (interval / 100), (interval % 100), (actual / 100),
+				    (actual % 100));
+		}
+
+		++i;
+	}
+
+	/* No device is excluded, so this is the window the next connection would scan with */
+	window = (plan_scan_window(load) * 625);
+	shell_print(sh, "Scan window %u.%02u ms", (window / 1000), ((window % 1000) / 10));
 
 	return 0;
 }
+#endif
+
+SHELL_STATIC_SUBCMD_SET_CREATE(ess_roster_cmd,
+	/* Command handlers */
+	SHELL_CMD_ARG(add, NULL, "Add device: <address> [name]", ess_roster_add_handler, 2, 1),
+	SHELL_CMD_ARG(remove, NULL, "Remove device: <device>", ess_roster_remove_handler, 2, 0),
+
+	/* Array terminator. */
+	SHELL_SUBCMD_SET_END
+);
+
+#ifdef CONFIG_APP_SCAN
+SHELL_STATIC_SUBCMD_SET_CREATE(ess_scan_cmd,
+	/* Command handlers */
+	SHELL_CMD_ARG(start, NULL, "Start scan: [seconds]", ess_scan_start_handler, 1, 1),
+	SHELL_CMD(stop, NULL, "Stop scan", ess_scan_stop_handler),
+	SHELL_CMD(list, NULL, "List ranked scan results", ess_scan_list_handler),
+	SHELL_CMD_ARG(adopt, NULL, "Adopt scan result: <result> [name]", ess_scan_adopt_handler, 2, 1),
+
+	/* Array terminator. */
+	SHELL_SUBCMD_SET_END
+);
+#endif
+
+#ifdef CONFIG_APP_TRACE
+SHELL_STATIC_SUBCMD_SET_CREATE(ess_trace_cmd,
+	/* Command handlers */
+	SHELL_CMD(start, NULL, "Start recording notifications", ess_trace_start_handler),
+	SHELL_CMD(stop, NULL, "Stop recording notifications", ess_trace_stop_handler),
+	SHELL_CMD(dump, NULL, "Output recorded trace as hex", ess_trace_dump_handler),
+	SHELL_CMD_ARG(replay, NULL, "Replay trace: [realtime]", ess_trace_replay_handler, 1, 1),
+
+	/* Array terminator. */
+	SHELL_SUBCMD_SET_END
+);
+#endif
+
+#ifdef CONFIG_APP_HISTORY
+SHELL_STATIC_SUBCMD_SET_CREATE(ess_history_cmd,
+	/* Command handlers */
+	SHELL_CMD(status, NULL, "Show history log status", ess_history_status_handler),
+	SHELL_CMD_ARG(read, NULL, "Output samples: [from]", ess_history_read_handler, 1, 1),
+#ifdef CONFIG_APP_HISTORY_EXPORT
+	SHELL_CMD_ARG(export, NULL, "Output compressed samples: [from]",
+		      ess_history_export_handler, 1, 1),
+#endif
+	SHELL_CMD_ARG(ack, NULL, "Set acknowledged position: <sequence>", ess_history_ack_handler,
+		      2, 0),
+	SHELL_CMD(flush, NULL, "Write pending samples", ess_history_flush_handler),
+	SHELL_CMD(erase, NULL, "Erase history log", ess_history_erase_handler),
+
+	/* Array terminator. */
+	SHELL_SUBCMD_SET_END
+);
+#endif
+
+#ifdef CONFIG_APP_ALARMS
+SHELL_STATIC_SUBCMD_SET_CREATE(ess_alarm_cmd,
+	/* Command handlers */
+	SHELL_CMD(list, NULL, "List alarm rules", ess_alarm_list_handler),
+	SHELL_CMD_ARG(add, NULL, "Add rule: <device|local> <field> <above|below> <threshold> "
+		      "<hysteresis> [fan speed]", ess_alarm_add_handler, 6, 1),
+	SHELL_CMD_ARG(remove, NULL, "Remove rule: <rule>", ess_alarm_remove_handler, 2, 0),
+
+	/* Array terminator. */
+	SHELL_SUBCMD_SET_END
+);
+#endif
 
 SHELL_STATIC_SUBCMD_SET_CREATE(ess_cmd,
 	/* Command handlers */
-	SHELL_CMD(readings, NULL, "Output ESS values", ess_readings_handler),
+	SHELL_CMD_ARG(readings, NULL, "Output ESS values", ess_readings_handler, 1, 1),
 	SHELL_CMD(disconnect, NULL, "Disconnect from all devices", ess_disconnect_handler),
 	SHELL_CMD(disable, NULL, "Disable fetching readings", ess_disable_handler),
 	SHELL_CMD(enable, NULL, "Enable fetching readings", ess_enable_handler),
 	SHELL_CMD(status, NULL, "Show device status", ess_status_handler),
+	SHELL_CMD(stats, NULL, "Show device connection statistics", ess_stats_handler),
+	SHELL_CMD(roster, &ess_roster_cmd, "Roster commands", NULL),
+#ifdef CONFIG_APP_ADAPTIVE_PHY
+	SHELL_CMD_ARG(phy, NULL, "Show or set PHY policy: [<device> <auto|1m|2m|coded>]",
+		      ess_phy_handler, 1, 2),
+#endif
+#ifdef CONFIG_APP_CONN_PLANNER
+	SHELL_CMD(plan, NULL, "Show connection plan", ess_plan_handler),
+#endif
+#ifdef CONFIG_APP_AGGREGATES
+	SHELL_CMD_ARG(aggregate, NULL, "Output windowed statistics: [window]", ess_aggregate_handler, 1, 1),
+#endif
+#ifdef CONFIG_APP_SCAN
+	SHELL_CMD(scan, &ess_scan_cmd, "Scan commands", NULL),
+#endif
+#ifdef CONFIG_APP_TRACE
+	SHELL_CMD(trace, &ess_trace_cmd, "Notification trace commands", NULL),
+#endif
+#ifdef CONFIG_APP_HISTORY
+	SHELL_CMD(history, &ess_history_cmd, "History log commands", NULL),
+#endif
+#ifdef CONFIG_APP_ALARMS
+	SHELL_CMD(alarm, &ess_alarm_cmd, "Threshold alarm commands", NULL),
+#endif
 
 	/* Array terminator. */
 	SHELL_SUBCMD_SET_END
@@ -1374,6 +6432,8 @@ SHELL_CMD_REGISTER(ess, &ess_cmd, "ESS profile commands", NULL);
 SHELL_STATIC_SUBCMD_SET_CREATE(fan_cmd,
 	/* Command handlers */
 	SHELL_CMD(speed, NULL, "Change fan speed", fan_speed_handler),
+	SHELL_CMD_ARG(ramp, NULL, "Show or set fan slew rate (%/s) and curve", fan_ramp_handler,
+		      1, 2),
 
 	/* Array terminator. */
 	SHELL_SUBCMD_SET_END
@@ -1386,6 +6446,14 @@ SHELL_STATIC_SUBCMD_SET_CREATE(app_cmd,
 	SHELL_CMD(reboot, NULL, "Reboot", app_reboot_handler),
 	SHELL_CMD(bootloader, NULL, "Enter bootloader", app_bootloader_handler),
 	SHELL_CMD(version, NULL, "Show version", app_version_handler),
+	SHELL_CMD(boot, NULL, "Show time from boot to first readings", app_boot_handler),
+	SHELL_CMD_ARG(time, NULL, "Get or set epoch time (ms)", app_time_handler, 1, 1),
+#ifdef CONFIG_APP_TELEMETRY
+	SHELL_CMD(telemetry, NULL, "Show telemetry channel status", app_telemetry_handler),
+#endif
+#ifdef CONFIG_APP_STACK_REPORT
+	SHELL_CMD(stacks, NULL, "Show thread stack usage", app_stacks_handler),
+#endif
 
 	/* Array terminator. */
 	SHELL_SUBCMD_SET_END
@@ -2,9 +2,131 @@
 #
 # All right reserved. This code is not apache or FOSS/copyleft licensed.
 
+# Outputs the current readings, or with "history [from]", back-fills stored history using
+# "ess history export"
+
 import serial
 import io
+import sys
+import base64
+import struct
+import zlib
+
+FIELDS = ["received", "temperature", "humidity", "pressure", "dew_point", "battery_level"]
+
+def varint(data, offset):
+    value = 0
+    shift = 0
+
+    while True:
+        byte = data[offset]
+        offset += 1
+        value |= (byte & 0x7f) << shift
+        shift += 7
+
+        if (byte & 0x80) == 0:
+            return value, offset
+
+def zigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+# Formats a 7 byte address (type then address, least significant byte first) as shown by
+# "ess status", all zero is the local sensor
+def address_text(data):
+    if not any(data):
+        return "LOCAL"
+
+    return "%02x" % data[0] + data[1:][::-1].hex()
+
+# Decodes one export block, returns a list of (sequence, time, address, fields) or None if the
+# CRC does not match
+def decode_block(line):
+    data = base64.b64decode(line)
+
+    if len(data) < 4 or struct.unpack("<I", data[-4:])[0] != zlib.crc32(data[:-4]):
+        return None
+
+    sequence, offset = varint(data, 0)
+    count, offset = varint(data, offset)
+    samples = []
+    previous = {}
+    addresses = {}
+    last = [0] * len(FIELDS)
+    time = 0
+    i = 0
+
+    while (i < count):
+        delta, offset = varint(data, offset)
+        time += zigzag(delta)
+        device = data[offset]
+        mask = data[offset + 1]
+        offset += 2
+
+        # The first sample of a device in the block is followed by its address
+        if device not in addresses:
+            addresses[device] = address_text(data[offset:offset + 7])
+            offset += 7
+
+        # A device's first sample in the block is relative to the sample before it
+        fields = previous.get(device, last)[:]
+        field = 0
+
+        while (field < len(FIELDS)):
+            if mask & (1 << field):
+                delta, offset = varint(data, offset)
+                fields[field] += zigzag(delta)
+
+            field = field + 1
+
+        previous[device] = fields
+        last = fields
+        samples.append((sequence + i, time, addresses[device], fields))
+        i = i + 1
+
+    return samples
+
+def history(ser, start):
+    ser.write(b"ess history export " + str(start).encode("utf-8") + b"\r\n")
+    next_sequence = start
+    received = 0
+
+    while True:
+        line = ser.readline()
+
+        if len(line) == 0:
+            # Timed out, the next run resumes from the last good block
+            break
+
+        received = received + len(line)
+        line = line.strip()
+
+        if line.startswith(b"Next: "):
+            break
+        elif not line.startswith(b"@"):
+            continue
+
+        samples = decode_block(line[1:])
+
+        if samples is None:
+            print("CRC mismatch, resume from " + str(next_sequence), file=sys.stderr)
+            break
+
+        for sequence, time, address, fields in samples:
+            print("sensor" + address + ",temperature=" + str(fields[1] / 100.0) +
+                  ",pressure=" + str(fields[3] / 10.0) + ",humidity=" + str(fields[2] / 100.0) +
+                  ",dew_point=" + str(fields[4]) + ",battery_level=" + str(fields[5]) + " " +
+                  str(time))
+            next_sequence = sequence + 1
+
+    print("Next: " + str(next_sequence) + " (" + str(received) + " bytes)", file=sys.stderr)
+
 ser = serial.Serial('/dev/ttyACM0', 115200, timeout=2)
+
+if len(sys.argv) > 1 and sys.argv[1] == "history":
+    history(ser, int(sys.argv[2]) if len(sys.argv) > 2 else 0)
+    ser.close()
+    sys.exit(0)
+
 ser.write(b"ess readings\r\n")
 rec = ser.read_until(expected=b"\n", size=None)
 